@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "agent.h"
+#include "utils.h"
+#include "ptrace.h"
+#include "pthreadlib.h"
+
+/* Agent expression opcodes (gdb/common/ax.def) */
+enum {
+  AX_ADD = 0x02, AX_SUB, AX_MUL, AX_DIV_SIGNED, AX_DIV_UNSIGNED,
+  AX_REM_SIGNED, AX_REM_UNSIGNED, AX_LSH, AX_RSH_SIGNED, AX_RSH_UNSIGNED,
+  AX_TRACE, AX_TRACE_QUICK, AX_LOG_NOT, AX_BIT_AND, AX_BIT_OR, AX_BIT_XOR,
+  AX_BIT_NOT, AX_EQUAL, AX_LESS_SIGNED, AX_LESS_UNSIGNED, AX_EXT,
+  AX_REF8, AX_REF16, AX_REF32, AX_REF64,
+  AX_IF_GOTO = 0x20, AX_GOTO, AX_CONST8, AX_CONST16, AX_CONST32, AX_CONST64,
+  AX_REG, AX_END, AX_DUP, AX_POP, AX_ZERO_EXT, AX_SWAP,
+  AX_GETV, AX_SETV, AX_TRACEV, AX_TRACENZ, AX_TRACE16,
+  AX_PICK = 0x32, AX_ROT, AX_PRINTF,
+};
+
+#define AX_STACK_MAX    64
+#define AX_NREGS        18      // d0-d7/a0-a7/ps/pc (same order as struct pt_regs)
+
+/* Parse "X<len>,<hex bytes>" and advance *p past it */
+struct agent_expr *agent_parse(char **p)
+{
+  char *s = *p;
+  if (*s++ != 'X')
+    return NULL;
+  size_t len = strtoul(s, &s, 16);
+  if (*s++ != ',' || len == 0 || strlen(s) < len * 2)
+    return NULL;
+
+  struct agent_expr *ax = malloc(sizeof(*ax) + len);
+  if (ax == NULL)
+    return NULL;
+  ax->next = NULL;
+  ax->len = len;
+  hex2mem(s, (char *)ax->bytes, len);
+  *p = s + len * 2;
+  return ax;
+}
+
+/* Free a list of expressions */
+void agent_free(struct agent_expr *ax)
+{
+  while (ax) {
+    struct agent_expr *next = ax->next;
+    free(ax);
+    ax = next;
+  }
+}
+
+/* Read size bytes of the target memory as a big endian value */
+static bool ax_ref(uint32_t addr, int size, int32_t *value)
+{
+  uint8_t buf[4];
+  struct ptrace_io_desc piod;
+
+  piod.piod_op = PIOD_READ_D;
+  piod.piod_offs = (void *)addr;
+  piod.piod_addr = buf;
+  piod.piod_len = size;
+  ptrace(PTRACE_IO, 0, &piod, NULL);
+  if (piod.piod_len != size)
+    return false;
+
+  uint32_t v = 0;
+  for (int i = 0; i < size; i++)
+    v = (v << 8) | buf[i];
+  *value = v;
+  return true;
+}
+
+/* Expand one backslash escape of the format string and advance *f past it */
+/* gdb sends the format string as written in the dprintf command, with C
+ * escapes not yet expanded.
+ */
+static char ax_escape(const char **f)
+{
+  const char *s = *f + 1;
+  char c = *s++;
+
+  switch (c) {
+  case 'n':   c = '\n'; break;
+  case 't':   c = '\t'; break;
+  case 'a':   c = '\a'; break;
+  case 'b':   c = '\b'; break;
+  case 'f':   c = '\f'; break;
+  case 'r':   c = '\r'; break;
+  case 'v':   c = '\v'; break;
+  case 'e':   c = '\033'; break;
+  case '\0':  s--; c = '\\'; break;        // trailing backslash
+  default:
+    if (c >= '0' && c <= '7') {
+      c -= '0';
+      for (int i = 0; i < 2 && *s >= '0' && *s <= '7'; i++)
+        c = (c << 3) | (*s++ - '0');
+    }
+    break;                      // '\\', '"' and others stand for themselves
+  }
+  *f = s;
+  return c;
+}
+
+/* Format the printf bytecode arguments and pass the result to agent_output() */
+/* All arguments are 32 bits, so length modifiers are ignored. */
+static void ax_printf(const char *format, int nargs, const int32_t *args)
+{
+  char out[256];
+  size_t n = 0;
+  int argi = 0;
+  const char *f = format;
+
+  while (*f && n < sizeof(out) - 1) {
+    if (*f == '\\') {
+      out[n++] = ax_escape(&f);
+      continue;
+    }
+    if (*f != '%') {
+      out[n++] = *f++;
+      continue;
+    }
+    if (f[1] == '%') {
+      out[n++] = '%';
+      f += 2;
+      continue;
+    }
+
+    char spec[16];
+    size_t sl = 0;
+    spec[sl++] = *f++;
+    while (*f && strchr("-+ #0123456789.", *f) && sl < sizeof(spec) - 2)
+      spec[sl++] = *f++;
+    while (*f == 'l' || *f == 'h' || *f == 'z' || *f == 'j' || *f == 't')
+      f++;
+    char conv = *f++;
+    if (argi >= nargs)
+      break;
+    int32_t v = args[argi++];
+
+    switch (conv) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+      spec[sl++] = conv;
+      spec[sl] = '\0';
+      n += snprintf(&out[n], sizeof(out) - n, spec, v);
+      break;
+    case 'p':
+      n += snprintf(&out[n], sizeof(out) - n, "0x%x", v);
+      break;
+    case 's':
+      {
+        char str[128];
+        struct ptrace_io_desc piod;
+        piod.piod_op = PIOD_READ_D;
+        piod.piod_offs = (void *)v;
+        piod.piod_addr = str;
+        piod.piod_len = sizeof(str) - 1;
+        ptrace(PTRACE_IO, 0, &piod, NULL);
+        str[piod.piod_len] = '\0';
+        spec[sl++] = 's';
+        spec[sl] = '\0';
+        n += snprintf(&out[n], sizeof(out) - n, spec, str);
+      }
+      break;
+    default:
+      f = "";             // unsupported conversion
+      break;
+    }
+    if (n > sizeof(out) - 1)
+      n = sizeof(out) - 1;
+  }
+  out[n] = '\0';
+  agent_output(out);
+}
+
+/* Evaluate an expression against the stopped target */
+/* Values are 32 bits wide. Returns 0 and the top of the stack at the end,
+ * or -1 on any error (bad bytecode, stack overflow, memory fault, ...).
+ */
+int agent_eval(const struct agent_expr *ax, int32_t *value)
+{
+  int32_t stack[AX_STACK_MAX];
+  int sp = 0;
+  size_t pc = 0;
+
+#define NEED(n)   do { if (sp < (n)) return -1; } while (0)
+#define ROOM(n)   do { if (sp + (n) > AX_STACK_MAX) return -1; } while (0)
+#define ARG(n)    do { if (pc + (n) > ax->len) return -1; } while (0)
+#define TOP       stack[sp - 1]
+#define NEXT      stack[sp - 2]
+
+  while (pc < ax->len) {
+    uint8_t op = ax->bytes[pc++];
+    int32_t t;
+    uint32_t u;
+
+    switch (op) {
+    case AX_ADD:          NEED(2); NEXT += TOP; sp--; break;
+    case AX_SUB:          NEED(2); NEXT -= TOP; sp--; break;
+    case AX_MUL:          NEED(2); NEXT *= TOP; sp--; break;
+    case AX_DIV_SIGNED:
+      NEED(2); if (TOP == 0) return -1;
+      NEXT /= TOP; sp--; break;
+    case AX_DIV_UNSIGNED:
+      NEED(2); if (TOP == 0) return -1;
+      NEXT = (uint32_t)NEXT / (uint32_t)TOP; sp--; break;
+    case AX_REM_SIGNED:
+      NEED(2); if (TOP == 0) return -1;
+      NEXT %= TOP; sp--; break;
+    case AX_REM_UNSIGNED:
+      NEED(2); if (TOP == 0) return -1;
+      NEXT = (uint32_t)NEXT % (uint32_t)TOP; sp--; break;
+    case AX_LSH:          NEED(2); NEXT = (uint32_t)NEXT << TOP; sp--; break;
+    case AX_RSH_SIGNED:   NEED(2); NEXT >>= TOP; sp--; break;
+    case AX_RSH_UNSIGNED: NEED(2); NEXT = (uint32_t)NEXT >> TOP; sp--; break;
+    case AX_LOG_NOT:      NEED(1); TOP = !TOP; break;
+    case AX_BIT_AND:      NEED(2); NEXT &= TOP; sp--; break;
+    case AX_BIT_OR:       NEED(2); NEXT |= TOP; sp--; break;
+    case AX_BIT_XOR:      NEED(2); NEXT ^= TOP; sp--; break;
+    case AX_BIT_NOT:      NEED(1); TOP = ~TOP; break;
+    case AX_EQUAL:        NEED(2); NEXT = (NEXT == TOP); sp--; break;
+    case AX_LESS_SIGNED:  NEED(2); NEXT = (NEXT < TOP); sp--; break;
+    case AX_LESS_UNSIGNED:
+      NEED(2); NEXT = ((uint32_t)NEXT < (uint32_t)TOP); sp--; break;
+
+    case AX_EXT:
+      ARG(1); NEED(1);
+      t = ax->bytes[pc++];
+      if (t > 0 && t < 32)
+        TOP = (int32_t)((uint32_t)TOP << (32 - t)) >> (32 - t);
+      break;
+    case AX_ZERO_EXT:
+      ARG(1); NEED(1);
+      t = ax->bytes[pc++];
+      if (t < 32)
+        TOP &= (1u << t) - 1;
+      break;
+
+    case AX_REF8:
+    case AX_REF16:
+    case AX_REF32:
+      NEED(1);
+      if (!ax_ref(TOP, 1 << (op - AX_REF8), &TOP))
+        return -1;
+      break;
+
+    case AX_IF_GOTO:
+      ARG(2); NEED(1);
+      u = (ax->bytes[pc] << 8) | ax->bytes[pc + 1];
+      pc += 2;
+      if (stack[--sp])
+        pc = u;
+      break;
+    case AX_GOTO:
+      ARG(2);
+      pc = (ax->bytes[pc] << 8) | ax->bytes[pc + 1];
+      break;
+
+    case AX_CONST8:
+    case AX_CONST16:
+    case AX_CONST32:
+    case AX_CONST64:
+      t = 1 << (op - AX_CONST8);
+      ARG(t); ROOM(1);
+      u = 0;
+      while (t-- > 0)
+        u = (u << 8) | ax->bytes[pc++];   // const64 keeps the lower 32 bits
+      stack[sp++] = u;
+      break;
+
+    case AX_REG:
+      ARG(2); ROOM(1);
+      u = (ax->bytes[pc] << 8) | ax->bytes[pc + 1];
+      pc += 2;
+      if (u >= AX_NREGS)
+        return -1;
+      stack[sp++] = ptrace(PTRACE_PEEKUSER, current_tid, (void *)(u * 4), NULL);
+      break;
+
+    case AX_END:
+      *value = sp > 0 ? TOP : 0;
+      return 0;
+
+    case AX_DUP:          NEED(1); ROOM(1); stack[sp] = TOP; sp++; break;
+    case AX_POP:          NEED(1); sp--; break;
+    case AX_SWAP:         NEED(2); t = TOP; TOP = NEXT; NEXT = t; break;
+    case AX_PICK:
+      ARG(1); ROOM(1);
+      t = ax->bytes[pc++];
+      NEED(t + 1);
+      stack[sp] = stack[sp - 1 - t];
+      sp++;
+      break;
+    case AX_ROT:
+      NEED(3);              // a b c => c a b
+      t = TOP;
+      TOP = NEXT;
+      NEXT = stack[sp - 3];
+      stack[sp - 3] = t;
+      break;
+
+    case AX_TRACE:        // addr size =>
+      NEED(2);
+      if (!agent_trace(NEXT, TOP))
+        return -1;
+      sp -= 2;
+      break;
+    case AX_TRACE_QUICK:  // addr => addr
+      ARG(1); NEED(1);
+      if (!agent_trace(TOP, ax->bytes[pc++]))
+        return -1;
+      break;
+    case AX_TRACE16:
+      ARG(2); NEED(1);
+      u = (ax->bytes[pc] << 8) | ax->bytes[pc + 1];
+      pc += 2;
+      if (!agent_trace(TOP, u))
+        return -1;
+      break;
+    case AX_TRACENZ:      // addr size => (up to and including the first zero byte)
+      NEED(2);
+      for (u = 0; u < (uint32_t)TOP; u++) {
+        if (!ax_ref(NEXT + u, 1, &t))
+          break;
+        if (t == 0) {
+          u++;
+          break;
+        }
+      }
+      if (!agent_trace(NEXT, u))
+        return -1;
+      sp -= 2;
+      break;
+
+    case AX_GETV:
+      ARG(2); ROOM(1);
+      u = (ax->bytes[pc] << 8) | ax->bytes[pc + 1];
+      pc += 2;
+      if (!agent_getv(u, &stack[sp]))
+        return -1;
+      sp++;
+      break;
+    case AX_SETV:         // v => v
+      ARG(2); NEED(1);
+      u = (ax->bytes[pc] << 8) | ax->bytes[pc + 1];
+      pc += 2;
+      if (!agent_setv(u, TOP))
+        return -1;
+      break;
+    case AX_TRACEV:
+      ARG(2);
+      u = (ax->bytes[pc] << 8) | ax->bytes[pc + 1];
+      pc += 2;
+      if (!agent_tracev(u))
+        return -1;
+      break;
+
+    case AX_PRINTF:
+      {
+        // nargs, format length (2 bytes), format string
+        // stack: args... chan fn
+        ARG(3);
+        int nargs = ax->bytes[pc];
+        size_t slen = (ax->bytes[pc + 1] << 8) | ax->bytes[pc + 2];
+        const char *format = (const char *)&ax->bytes[pc + 3];
+        pc += 3;
+        ARG(slen);
+        pc += slen;
+        if (slen == 0 || format[slen - 1] != '\0')
+          return -1;
+        NEED(2 + nargs);
+        sp -= 2;          // function and channel are not used
+        int32_t args[AX_STACK_MAX];
+        for (int i = 0; i < nargs; i++)
+          args[i] = stack[--sp];
+        ax_printf(format, nargs, args);
+      }
+      break;
+
+    default:              // floating point, ...
+      return -1;
+    }
+  }
+  return -1;              // ran off the end without "end"
+
+#undef NEED
+#undef ROOM
+#undef ARG
+#undef TOP
+#undef NEXT
+}
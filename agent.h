@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AGENT_H
+#define AGENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Agent expression bytecode received from gdb */
+struct agent_expr
+{
+  struct agent_expr *next;
+  size_t len;
+  uint8_t bytes[];
+};
+
+struct agent_expr *agent_parse(char **p);
+void agent_free(struct agent_expr *ax);
+int agent_eval(const struct agent_expr *ax, int32_t *value);
+
+/* Output of the printf bytecode (implemented by the caller) */
+void agent_output(const char *str);
+
+/* Tracing and trace state variable bytecodes (implemented in tracepoint.c) */
+bool agent_trace(uint32_t addr, size_t length);
+bool agent_tracev(uint32_t num);
+bool agent_getv(uint32_t num, int32_t *value);
+bool agent_setv(uint32_t num, int32_t value);
+
+#endif /* AGENT_H */
@@ -12,7 +12,7 @@ struct reg_struct
 #define ARCH_REG_NUM (sizeof(regs_map) / sizeof(struct reg_struct))
 
 #define SZ 4
-#define FEATURE_STR "l<target version=\"1.0\">\
+#define FEATURE_STR "<target version=\"1.0\">\
   <architecture>m68k:68000</architecture>\
   <osabi>none</osabi>\
   <feature name=\"org.gnu.gdb.m68k.core\">\
@@ -46,7 +46,7 @@ static uint8_t break_instr[] = {0x4e, 0x49};
 
 typedef struct pt_regs regs_struct;
 
-struct reg_struct regs_map[] = {
+static struct reg_struct regs_map[] = {
     {0, 4},
     {1, 4},
     {2, 4},
@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "breakpoint.h"
+#include "ptrace.h"
+#include "arch.h"
+
+#define BP_SIZE         sizeof(break_instr)
+
+/* Kinds of breakpoints which need the trap instruction in the target memory */
+#define BP_PLANTED      (BP_WANTED | BP_INTERNAL | BP_TRACE | BP_COVER | BP_ENTRY | BP_EXIT)
+
+/* Breakpoint table sorted by address */
+/* Z/z packets only update the table. The trap instructions are written to
+ * (or removed from) the target in one batch by breakpoint_sync() just before
+ * the target is resumed, so the instruction cache is flushed only once.
+ */
+static struct breakpoint *bp_table;
+static int bp_num;
+static int bp_max;
+int bp_hw_num;                  // number of breakpoints with BP_HW
+
+/* Read/write one instruction word of the target */
+static bool access_insn(int op, size_t addr, uint16_t *insn)
+{
+  struct ptrace_io_desc piod;
+
+  piod.piod_op = op;
+  piod.piod_offs = (void *)addr;
+  piod.piod_addr = insn;
+  piod.piod_len = BP_SIZE;
+  ptrace(PTRACE_IO, 0, &piod, NULL);
+  return piod.piod_len == BP_SIZE;
+}
+
+/* Whether a trap can be written at addr (ROM and unmapped memory fail) */
+/* The trap is written once, read back and replaced with orig again, so
+ * gdb gets an error for the Z packet and can fall back to Z1.
+ */
+static bool bp_writable(size_t addr, uint16_t orig)
+{
+  uint16_t insn, check;
+
+  memcpy(&insn, break_instr, BP_SIZE);
+  if (!access_insn(PIOD_WRITE_D, addr, &insn))
+    return false;
+  bool ok = access_insn(PIOD_READ_D, addr, &check) && check == insn;
+  access_insn(PIOD_WRITE_D, addr, &orig);
+  return ok;
+}
+
+/* Returns the index of the first breakpoint whose address is >= addr */
+static int bp_search(size_t addr)
+{
+  int lo = 0, hi = bp_num;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (bp_table[mid].addr < addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Returns the index of the first breakpoint which may overlap addr */
+static int bp_first(size_t addr)
+{
+  return bp_search(addr >= BP_SIZE - 1 ? addr - (BP_SIZE - 1) : 0);
+}
+
+static void bp_delete(int i)
+{
+  agent_free(bp_table[i].cond);
+  agent_free(bp_table[i].cmds);
+  bp_num--;
+  memmove(&bp_table[i], &bp_table[i + 1], (bp_num - i) * sizeof(*bp_table));
+}
+
+/* Returns the index-th breakpoint in address order, or NULL */
+struct breakpoint *breakpoint_get(int index)
+{
+  return index < bp_num ? &bp_table[index] : NULL;
+}
+
+struct breakpoint *breakpoint_find(size_t addr)
+{
+  int i = bp_search(addr);
+  if (i < bp_num && bp_table[i].addr == addr)
+    return &bp_table[i];
+  return NULL;
+}
+
+/* Request a breakpoint of the kind (BP_WANTED: Z0, BP_HW: Z1, ...) at addr */
+bool breakpoint_insert(size_t addr, int kind)
+{
+  uint16_t insn;
+  int i = bp_search(addr);
+
+  if (i < bp_num && bp_table[i].addr == addr) {
+    if ((kind & BP_PLANTED) && !(bp_table[i].flags & (BP_PLANTED | BP_INSERTED)) &&
+        !(access_insn(PIOD_READ_D, addr, &insn) && bp_writable(addr, insn)))
+      return false;
+    if (kind == BP_HW && !(bp_table[i].flags & BP_HW))
+      bp_hw_num++;
+    bp_table[i].flags |= kind;
+    return true;
+  }
+
+  if ((addr & 1) || !access_insn(PIOD_READ_D, addr, &insn))
+    return false;
+  if ((kind & BP_PLANTED) && !bp_writable(addr, insn))
+    return false;
+
+  if (bp_num == bp_max) {
+    int max = bp_max ? bp_max * 2 : 64;
+    struct breakpoint *table = realloc(bp_table, max * sizeof(*bp_table));
+    if (table == NULL)
+      return false;
+    bp_table = table;
+    bp_max = max;
+  }
+  memmove(&bp_table[i + 1], &bp_table[i], (bp_num - i) * sizeof(*bp_table));
+  bp_num++;
+  bp_table[i].addr = addr;
+  bp_table[i].orig_insn = 0;
+  bp_table[i].flags = kind;
+  bp_table[i].cond = NULL;
+  bp_table[i].cmds = NULL;
+  bp_table[i].hit_count = 0;
+  bp_table[i].ignore_count = 0;
+  if (kind == BP_HW)
+    bp_hw_num++;
+  return true;
+}
+
+bool breakpoint_remove(size_t addr, int kind)
+{
+  struct breakpoint *bp = breakpoint_find(addr);
+
+  if (bp == NULL || !(bp->flags & kind))
+    return false;
+  bp->flags &= ~kind;
+  if (kind == BP_HW)
+    bp_hw_num--;
+  if (!(bp->flags & (BP_PLANTED | BP_HW | BP_INSERTED)))
+    bp_delete(bp - bp_table);
+  return true;
+}
+
+/* Replace the condition list of the breakpoint (the list is owned by it) */
+void breakpoint_set_condition(size_t addr, struct agent_expr *cond)
+{
+  struct breakpoint *bp = breakpoint_find(addr);
+
+  if (bp == NULL) {
+    agent_free(cond);
+    return;
+  }
+  agent_free(bp->cond);
+  bp->cond = cond;
+}
+
+/* Replace the command list of the breakpoint (the list is owned by it) */
+void breakpoint_set_commands(size_t addr, struct agent_expr *cmds)
+{
+  struct breakpoint *bp = breakpoint_find(addr);
+
+  if (bp == NULL) {
+    agent_free(cmds);
+    return;
+  }
+  agent_free(bp->cmds);
+  bp->cmds = cmds;
+}
+
+/* Decide whether the target should stop at the breakpoint at addr */
+/* kind is BP_INSERTED when the target hit trap #9, or BP_HW when it was traced
+ * to addr. Called in the target context, so everything is done on the 68k
+ * without talking to gdb. Traps not placed by gdbserver always stop.
+ */
+bool breakpoint_stop(size_t addr, int kind)
+{
+  struct breakpoint *bp = breakpoint_find(addr);
+
+  if (bp == NULL || !(bp->flags & kind))
+    return kind != BP_HW;
+  if (kind == BP_INSERTED && !(bp->flags & BP_WANTED))
+    return false;       // planted only for gdbserver itself (e.g. a tracepoint)
+
+  if (bp->cond) {
+    struct agent_expr *ax;
+    for (ax = bp->cond; ax; ax = ax->next) {
+      int32_t value;
+      if (agent_eval(ax, &value) < 0 || value)
+        break;          // evaluation errors stop the target too
+    }
+    if (ax == NULL)
+      return false;
+  }
+
+  bp->hit_count++;
+  if (bp->ignore_count) {
+    bp->ignore_count--;
+    return false;
+  }
+
+  if (bp->cmds) {
+    for (struct agent_expr *ax = bp->cmds; ax; ax = ax->next) {
+      int32_t value;
+      if (agent_eval(ax, &value) < 0)
+        return true;
+    }
+    return false;
+  }
+  return true;
+}
+
+/* Apply all pending insertions and removals to the target memory */
+void breakpoint_sync(void)
+{
+  int i = 0;
+
+  while (i < bp_num) {
+    struct breakpoint *bp = &bp_table[i];
+
+    if (bp->flags & BP_PLANTED) {
+      if (!(bp->flags & BP_INSERTED)) {
+        uint16_t insn;
+        memcpy(&insn, break_instr, BP_SIZE);
+        if (access_insn(PIOD_READ_D, bp->addr, &bp->orig_insn) &&
+            access_insn(PIOD_WRITE_D, bp->addr, &insn))
+          bp->flags |= BP_INSERTED;
+      }
+    } else if (bp->flags & BP_INSERTED) {
+      access_insn(PIOD_WRITE_D, bp->addr, &bp->orig_insn);
+      bp->flags &= ~BP_INSERTED;
+    }
+    if (!(bp->flags & (BP_PLANTED | BP_HW))) {
+      bp_delete(i);
+      continue;
+    }
+    i++;
+  }
+}
+
+/* Whether a BP_HW breakpoint lies in [addr, addr + length) */
+bool breakpoint_hw_ahead(size_t addr, size_t length)
+{
+  for (int i = bp_search(addr); i < bp_num && bp_table[i].addr < addr + length; i++) {
+    if (bp_table[i].flags & BP_HW)
+      return true;
+  }
+  return false;
+}
+
+/* Take out the inserted breakpoints in the range before it is overwritten */
+/* They will be inserted again with the new contents at the next resume. */
+void breakpoint_lift(size_t addr, size_t length)
+{
+  for (int i = bp_first(addr); i < bp_num; i++) {
+    struct breakpoint *bp = &bp_table[i];
+    if (bp->addr >= addr + length)
+      break;
+    if (bp->flags & BP_INSERTED) {
+      access_insn(PIOD_WRITE_D, bp->addr, &bp->orig_insn);
+      bp->flags &= ~BP_INSERTED;
+    }
+  }
+}
+
+/* Replace inserted breakpoints in buf (read from addr) with the original data */
+void breakpoint_mask(size_t addr, uint8_t *buf, size_t length)
+{
+  for (int i = bp_first(addr); i < bp_num; i++) {
+    struct breakpoint *bp = &bp_table[i];
+    if (bp->addr >= addr + length)
+      break;
+    if (!(bp->flags & BP_INSERTED))
+      continue;
+    for (int j = 0; j < BP_SIZE; j++) {
+      if (bp->addr + j >= addr && bp->addr + j < addr + length)
+        buf[bp->addr + j - addr] = ((uint8_t *)&bp->orig_insn)[j];
+    }
+  }
+}
+
+/****************************************************************************/
+
+/* Software watchpoints */
+/* The target is traced one instruction at a time while any watchpoint is
+ * set, and the watched ranges are compared with their last contents after
+ * every trace exception. Only changes of the value can be detected, so read
+ * watchpoints are not supported and access watchpoints trigger on writes
+ * that change the value.
+ */
+#define WATCHPOINT_NUMBER   16
+#define WATCH_MAX_LEN       256
+
+static struct watchpoint wp_table[WATCHPOINT_NUMBER];
+int wp_num;
+
+static bool read_memory(size_t addr, void *buf, size_t length)
+{
+  struct ptrace_io_desc piod;
+
+  piod.piod_op = PIOD_READ_D;
+  piod.piod_offs = (void *)addr;
+  piod.piod_addr = buf;
+  piod.piod_len = length;
+  ptrace(PTRACE_IO, 0, &piod, NULL);
+  return piod.piod_len == length;
+}
+
+bool watchpoint_insert(int type, size_t addr, size_t length)
+{
+  struct watchpoint *wp;
+
+  if ((type != WP_WRITE && type != WP_ACCESS) ||
+      length == 0 || length > WATCH_MAX_LEN || wp_num == WATCHPOINT_NUMBER)
+    return false;
+
+  wp = &wp_table[wp_num];
+  if ((wp->value = malloc(length)) == NULL)
+    return false;
+  if (!read_memory(addr, wp->value, length)) {
+    free(wp->value);
+    return false;
+  }
+  wp->addr = addr;
+  wp->len = length;
+  wp->type = type;
+  wp_num++;
+  return true;
+}
+
+bool watchpoint_remove(int type, size_t addr, size_t length)
+{
+  for (int i = 0; i < wp_num; i++) {
+    struct watchpoint *wp = &wp_table[i];
+    if (wp->type == type && wp->addr == addr && wp->len == length) {
+      free(wp->value);
+      wp_num--;
+      memmove(wp, wp + 1, (wp_num - i) * sizeof(*wp));
+      return true;
+    }
+  }
+  return false;
+}
+
+struct watchpoint *watchpoint_find(size_t addr)
+{
+  for (int i = 0; i < wp_num; i++) {
+    if (wp_table[i].addr == addr)
+      return &wp_table[i];
+  }
+  return NULL;
+}
+
+/* Returns the first watchpoint whose value has changed since the last check */
+/* Called in the target context after every trace exception. */
+struct watchpoint *watchpoint_check(void)
+{
+  uint8_t buf[WATCH_MAX_LEN];
+  struct watchpoint *hit = NULL;
+
+  for (int i = 0; i < wp_num; i++) {
+    struct watchpoint *wp = &wp_table[i];
+    if (read_memory(wp->addr, buf, wp->len) && memcmp(buf, wp->value, wp->len)) {
+      memcpy(wp->value, buf, wp->len);
+      if (hit == NULL)
+        hit = wp;
+    }
+  }
+  return hit;
+}
+
+/* Take the current contents as the reference values (gdb may have written them) */
+void watchpoint_snapshot(void)
+{
+  for (int i = 0; i < wp_num; i++)
+    read_memory(wp_table[i].addr, wp_table[i].value, wp_table[i].len);
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BREAKPOINT_H
+#define BREAKPOINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "agent.h"
+
+#define BP_WANTED       0x01    // requested by Z packet
+#define BP_INSERTED     0x02    // trap instruction is written in the target memory
+#define BP_HW           0x04    // requested by Z1 (served by tracing, never written)
+#define BP_INTERNAL     0x08    // used by gdbserver itself (not visible to gdb)
+#define BP_TRACE        0x10    // planted for a tracepoint (QTStart)
+#define BP_COVER        0x20    // planted for coverage (removed at the first hit)
+#define BP_ENTRY        0x40    // function entry for timing
+#define BP_EXIT         0x80    // return address of a timed call in progress
+
+struct breakpoint
+{
+  uint32_t addr;
+  uint16_t orig_insn;           // original instruction word (valid while inserted)
+  uint8_t flags;
+  struct agent_expr *cond;      // stop only when one of these is true (NULL: always)
+  struct agent_expr *cmds;      // run these and continue instead of stopping (dprintf)
+  uint32_t hit_count;           // number of hits with the condition true
+  uint32_t ignore_count;        // number of stops to skip silently
+};
+
+/* Watchpoint types (same as the Z packet type) */
+#define WP_WRITE        2
+#define WP_READ         3
+#define WP_ACCESS       4
+
+struct watchpoint
+{
+  uint32_t addr;
+  uint32_t len;
+  int type;
+  uint8_t *value;               // contents at the last check
+};
+
+struct breakpoint *breakpoint_get(int index);
+struct breakpoint *breakpoint_find(size_t addr);
+bool breakpoint_insert(size_t addr, int kind);
+bool breakpoint_remove(size_t addr, int kind);
+void breakpoint_set_condition(size_t addr, struct agent_expr *cond);
+void breakpoint_set_commands(size_t addr, struct agent_expr *cmds);
+bool breakpoint_stop(size_t addr, int kind);
+bool breakpoint_hw_ahead(size_t addr, size_t length);
+void breakpoint_sync(void);
+void breakpoint_lift(size_t addr, size_t length);
+void breakpoint_mask(size_t addr, uint8_t *buf, size_t length);
+
+bool watchpoint_insert(int type, size_t addr, size_t length);
+bool watchpoint_remove(int type, size_t addr, size_t length);
+struct watchpoint *watchpoint_find(size_t addr);
+struct watchpoint *watchpoint_check(void);
+void watchpoint_snapshot(void);
+
+/* Whether the target has to be traced for Z1 breakpoints or watchpoints */
+extern int bp_hw_num;
+extern int wp_num;
+#define breakpoint_hw_active()  (bp_hw_num > 0)
+#define watchpoint_active()     (wp_num > 0)
+
+#endif /* BREAKPOINT_H */
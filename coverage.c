@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "coverage.h"
+#include "breakpoint.h"
+
+/* Basic-block coverage */
+/* The host registers the addresses of the basic blocks, and a BP_COVER
+ * breakpoint is planted at each of them. When one is hit, the bit of the
+ * block is set and the breakpoint is removed, so the target continues
+ * without reporting to gdb and runs at full speed through the block after
+ * that. Bit n of the bitmap (bit n % 8 of byte n / 8) belongs to the n-th
+ * registered address.
+ */
+struct cov_block
+{
+  uint32_t addr;
+  uint32_t index;               // position in the host's list
+};
+
+static struct cov_block *cov_table;     // sorted by address
+static int cov_num;
+static int cov_max;
+static uint8_t *cov_bitmap;
+static int cov_hits;
+
+/* Remove all blocks and their breakpoints */
+void coverage_init(void)
+{
+  for (int i = 0; i < cov_num; i++)
+    breakpoint_remove(cov_table[i].addr, BP_COVER);
+  free(cov_table);
+  free(cov_bitmap);
+  cov_table = NULL;
+  cov_bitmap = NULL;
+  cov_num = 0;
+  cov_max = 0;
+  cov_hits = 0;
+}
+
+static int cov_compare(const void *a, const void *b)
+{
+  uint32_t aa = ((const struct cov_block *)a)->addr;
+  uint32_t ab = ((const struct cov_block *)b)->addr;
+  return aa < ab ? -1 : aa > ab ? 1 : 0;
+}
+
+/* Search the first num blocks (which are sorted) */
+static struct cov_block *cov_find(size_t addr, int num)
+{
+  struct cov_block key = { addr, 0 };
+  return bsearch(&key, cov_table, num, sizeof(*cov_table), cov_compare);
+}
+
+/* Register the comma-separated block addresses (in hex) after the existing ones */
+/* If any address cannot be registered, none of the packet is kept, so that
+ * the indexes of the bits stay in step with the host's list.
+ */
+bool coverage_add(char *p)
+{
+  bool result = true;
+  int sorted = cov_num;
+
+  while (*p) {
+    uint32_t addr = strtoul(p, &p, 16);
+    if (*p == ',')
+      p++;
+    else if (*p) {
+      result = false;
+      break;
+    }
+
+    if (cov_num == cov_max) {
+      int max = cov_max ? cov_max * 2 : 256;
+      struct cov_block *table = realloc(cov_table, max * sizeof(*cov_table));
+      uint8_t *bitmap = realloc(cov_bitmap, max / 8);
+      if (table)
+        cov_table = table;
+      if (bitmap)
+        cov_bitmap = bitmap;
+      if (table == NULL || bitmap == NULL) {
+        result = false;
+        break;
+      }
+      memset(&cov_bitmap[cov_max / 8], 0, (max - cov_max) / 8);
+      cov_max = max;
+    }
+    // Duplicates would leave a bit which can never be set
+    struct breakpoint *bp = breakpoint_find(addr);
+    if ((bp && (bp->flags & BP_COVER)) || cov_find(addr, sorted) ||
+        !breakpoint_insert(addr, BP_COVER)) {
+      result = false;
+      break;
+    }
+    cov_table[cov_num].addr = addr;
+    cov_table[cov_num].index = cov_num;
+    cov_num++;
+  }
+  if (!result) {
+    while (cov_num > sorted)
+      breakpoint_remove(cov_table[--cov_num].addr, BP_COVER);
+    return false;
+  }
+  qsort(cov_table, cov_num, sizeof(*cov_table), cov_compare);
+  return true;
+}
+
+/* Record the hit of the block at addr and remove its breakpoint */
+/* Called in the target context when it hit trap #9. The trap is taken out of
+ * the target memory by the next breakpoint_sync().
+ */
+bool coverage_hit(size_t addr)
+{
+  struct breakpoint *bp = breakpoint_find(addr);
+  struct cov_block *cb;
+
+  if (bp == NULL || !(bp->flags & BP_COVER) || (cb = cov_find(addr, cov_num)) == NULL)
+    return false;
+  cov_bitmap[cb->index / 8] |= 1 << (cb->index % 8);
+  cov_hits++;
+  breakpoint_remove(addr, BP_COVER);
+  return true;
+}
+
+int coverage_count(void)
+{
+  return cov_num;
+}
+
+int coverage_hits(void)
+{
+  return cov_hits;
+}
+
+const uint8_t *coverage_bitmap(size_t *size)
+{
+  *size = (cov_num + 7) / 8;
+  return cov_bitmap;
+}
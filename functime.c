@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "functime.h"
+#include "breakpoint.h"
+#include "profile.h"
+#include "pthreadlib.h"
+
+/* Function entry/exit timing */
+/* A BP_ENTRY breakpoint is planted at the entry of each registered function.
+ * When it is hit, the return address is read from the stack and a BP_EXIT
+ * breakpoint is planted there. When that one is hit with the stack pointer
+ * just above the frame, the call is complete and the elapsed time is added
+ * to the function. Everything is done in the target context, so the target
+ * is not stopped.
+ *
+ * The calls in progress are kept on a shadow stack. Each frame records the
+ * thread which made the call, and only the frames of the thread hitting an
+ * exit breakpoint are compared with its stack pointer. Frames which are left
+ * without returning (longjmp etc.) are discarded when a frame outside them
+ * returns in the same thread. The time includes the overhead of the
+ * breakpoints hit inside the call.
+ */
+#define FUNCTIME_DEPTH  64
+
+static struct functime *ft_table;       // sorted by address
+static int ft_num;
+static int ft_max;
+uint32_t functime_dropped;
+
+static struct {
+  struct functime *func;
+  int tid;                      // thread which made the call
+  uint32_t ret;                 // return address
+  uint32_t sp;                  // stack pointer at the entry
+  uint32_t start;
+} ft_stack[FUNCTIME_DEPTH];
+static int ft_depth;
+
+static bool read_memory(size_t addr, void *buf, size_t length)
+{
+  struct ptrace_io_desc piod;
+
+  piod.piod_op = PIOD_READ_D;
+  piod.piod_offs = (void *)addr;
+  piod.piod_addr = buf;
+  piod.piod_len = length;
+  ptrace(PTRACE_IO, 0, &piod, NULL);
+  return piod.piod_len == length;
+}
+
+/* Remove the i-th frame, and its exit breakpoint unless another call in
+ * progress returns there */
+static void ft_remove(int i)
+{
+  uint32_t ret = ft_stack[i].ret;
+  ft_depth--;
+  memmove(&ft_stack[i], &ft_stack[i + 1], (ft_depth - i) * sizeof(ft_stack[0]));
+  for (i = 0; i < ft_depth; i++) {
+    if (ft_stack[i].ret == ret)
+      return;
+  }
+  breakpoint_remove(ret, BP_EXIT);
+}
+
+/* Thread running in the target (0 without PROCESS=) */
+static int ft_current_tid(void)
+{
+  return PRC_TABLE ? get_current_tid() : 0;
+}
+
+/* Remove all functions and their breakpoints */
+void functime_init(void)
+{
+  while (ft_depth > 0)
+    ft_remove(ft_depth - 1);
+  for (int i = 0; i < ft_num; i++)
+    breakpoint_remove(ft_table[i].addr, BP_ENTRY);
+  free(ft_table);
+  ft_table = NULL;
+  ft_num = 0;
+  ft_max = 0;
+  functime_dropped = 0;
+  profile_clock = false;
+}
+
+static int ft_compare(const void *a, const void *b)
+{
+  uint32_t aa = ((const struct functime *)a)->addr;
+  uint32_t ab = ((const struct functime *)b)->addr;
+  return aa < ab ? -1 : aa > ab ? 1 : 0;
+}
+
+/* Register the comma-separated entry addresses (in hex) */
+bool functime_add(char *p)
+{
+  bool result = true;
+
+  if (ft_depth > 0)
+    return false;               // the table would be reordered under the shadow stack
+
+  while (*p) {
+    uint32_t addr = strtoul(p, &p, 16);
+    if (*p == ',')
+      p++;
+    else if (*p) {
+      result = false;
+      break;
+    }
+
+    if (ft_num == ft_max) {
+      int max = ft_max ? ft_max * 2 : 64;
+      struct functime *table = realloc(ft_table, max * sizeof(*ft_table));
+      if (table == NULL) {
+        result = false;
+        break;
+      }
+      ft_table = table;
+      ft_max = max;
+    }
+    struct breakpoint *bp = breakpoint_find(addr);
+    if (bp && (bp->flags & BP_ENTRY))
+      continue;                 // already registered
+    if (!breakpoint_insert(addr, BP_ENTRY)) {
+      result = false;
+      break;
+    }
+    ft_table[ft_num].addr = addr;
+    ft_table[ft_num].calls = 0;
+    ft_table[ft_num].time = 0;
+    ft_num++;
+  }
+  qsort(ft_table, ft_num, sizeof(*ft_table), ft_compare);
+  profile_clock = (ft_num > 0);
+  return result;
+}
+
+/* Account the entry or exit breakpoint at the PC */
+/* Called in the target context when it hit trap #9. Returns true if the
+ * breakpoint was one of them. The entry breakpoint stays planted and is
+ * stepped over by the caller.
+ */
+bool functime_hit(const struct pt_regs *regs)
+{
+  struct breakpoint *bp = breakpoint_find(regs->pc);
+  uint32_t sp = (regs->sr & 0x2000) ? regs->ssp : regs->usp;
+  uint32_t now = profile_time();
+  int tid = ft_current_tid();
+  bool hit = false;
+
+  if (bp == NULL)
+    return false;
+
+  if (bp->flags & BP_EXIT) {
+    // After rts the stack pointer is 4 bytes above the one at the entry
+    for (int i = ft_depth - 1; i >= 0; i--) {
+      if (ft_stack[i].tid != tid)
+        continue;
+      if (ft_stack[i].sp >= sp)
+        break;                  // still in progress
+      if (ft_stack[i].ret == regs->pc && ft_stack[i].sp + 4 == sp) {
+        uint32_t start = ft_stack[i].start;
+        ft_stack[i].func->time += (now > start) ? now - start : 0;
+      } else {
+        functime_dropped++;
+      }
+      ft_remove(i);
+    }
+    hit = true;
+  }
+
+  if (bp->flags & BP_ENTRY) {
+    struct functime key = { regs->pc };
+    struct functime *f = bsearch(&key, ft_table, ft_num, sizeof(*ft_table), ft_compare);
+    uint32_t ret;
+    if (f) {
+      f->calls++;
+      if (ft_depth < FUNCTIME_DEPTH && read_memory(sp, &ret, 4) &&
+          breakpoint_insert(ret, BP_EXIT)) {
+        ft_stack[ft_depth].func = f;
+        ft_stack[ft_depth].tid = tid;
+        ft_stack[ft_depth].ret = ret;
+        ft_stack[ft_depth].sp = sp;
+        ft_stack[ft_depth].start = now;
+        ft_depth++;
+      } else {
+        functime_dropped++;
+      }
+    }
+    hit = true;
+  }
+  return hit;
+}
+
+/* Returns the index-th function in address order, or NULL */
+struct functime *functime_get(int index)
+{
+  return index < ft_num ? &ft_table[index] : NULL;
+}
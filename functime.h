@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FUNCTIME_H
+#define FUNCTIME_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "ptrace.h"
+
+struct functime
+{
+  uint32_t addr;                // entry address
+  uint32_t calls;
+  uint32_t time;                // inclusive time in PROFILE_TIME_US units
+};
+
+extern uint32_t functime_dropped;       // calls whose time was not measured
+
+void functime_init(void);
+bool functime_add(char *p);
+bool functime_hit(const struct pt_regs *regs);
+struct functime *functime_get(int index);
+
+#endif /* FUNCTIME_H */
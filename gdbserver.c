@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
@@ -26,6 +27,12 @@
 #include "utils.h"
 #include "packets.h"
 #include "ptrace.h"
+#include "breakpoint.h"
+#include "tracepoint.h"
+#include "record.h"
+#include "profile.h"
+#include "coverage.h"
+#include "functime.h"
 #include "pthreadlib.h"
 #include <x68k/dos.h>
 #include <x68k/iocs.h>
@@ -38,259 +45,1008 @@ int intrmode = 0;
 int ctrlc = 0;
 int select_tid = 0;
 
-#define BREAKPOINT_NUMBER 64
-
-struct debug_breakpoint_t
-{
-  size_t addr;
-  size_t orig_data;
-} breakpoints[BREAKPOINT_NUMBER];
-
-uint8_t tmpbuf[0x20000];
 bool attach = false;
 
+uint8_t membuf[0x8000];
+
 char msgbuf[256];
 
-void prepare_resume_reply(uint8_t *buf, bool cont, int result, int exitcode)
+void write_resume_reply(int result, int exitcode)
 {
   if (result < 0) {
-    sprintf(buf, "W%02x", exitcode);
+    write_packet_start();
+    write_packet_printf("W%02x", exitcode);
+    write_packet_end();
     terminate = true;
   } else {
-    if (current_tid < 0) {
-      sprintf(buf, "S%02x", exitcode);
-    } else {
-      sprintf(buf, "T%02xthread:%x;", exitcode, current_tid + 1);
+    /* Expedite fp, sp, ps and pc so that gdb need not read all registers */
+    static const int expedite[] = { 14, 15, 16, 17 };
+    regs_struct regs;
+    struct ptrace_siginfo si;
+    ptrace(PTRACE_GETREGS, current_tid, NULL, &regs);
+    ptrace(PTRACE_GETSIGINFO, current_tid, NULL, &si);
+
+    write_packet_start();
+    write_packet_printf("T%02x", exitcode);
+    for (int i = 0; i < sizeof(expedite) / sizeof(expedite[0]); i++) {
+      int r = expedite[i];
+      write_packet_printf("%02x:%08x;", r, *((uint32_t *)&regs + regs_map[r].idx));
     }
+    if (current_tid >= 0) {
+      write_packet_printf("thread:%x;", current_tid + 1);
+    }
+    if (si.si_code == TRAP_BRKPT) {
+      struct breakpoint *bp = breakpoint_find((size_t)si.si_addr);
+      if (bp && (bp->flags & BP_INSERTED) && (bp->flags & BP_WANTED))
+        write_packet_str("swbreak:;");
+    } else if (si.si_code == TRAP_HWBKPT) {
+      write_packet_str("hwbreak:;");
+    } else if (si.si_code == TRAP_WATCHPT) {
+      struct watchpoint *wp = watchpoint_find((size_t)si.si_addr);
+      if (wp)
+        write_packet_printf("%s:%x;", wp->type == WP_ACCESS ? "awatch" : "watch", wp->addr);
+    } else if (si.si_code == TRAP_REPLAY) {
+      write_packet_str("replaylog:begin;");
+    }
+    write_packet_end();
   }
 }
 
-void process_xfer(const char *name, char *args)
+/* Packet dispatch table */
+/* name matches the head of the payload followed by ':', ',', ';' or the end
+ * of the payload, and the handler receives the rest after the delimiter.
+ */
+struct packet_handler
 {
-  const char *mode = args;
-  args = strchr(args, ':');
-  *args++ = '\0';
-  if (!strcmp(name, "features") && !strcmp(mode, "read"))
-    write_packet(FEATURE_STR);
+  const char *name;
+  void (*func)(char *args);
+};
+
+bool dispatch_packet(const struct packet_handler *table, char *payload)
+{
+  for (; table->name; table++)
+  {
+    size_t len = strlen(table->name);
+    if (strncmp(payload, table->name, len))
+      continue;
+    char delim = payload[len];
+    if (delim != ':' && delim != ',' && delim != ';' && delim != '\0')
+      continue;
+    table->func(delim ? &payload[len + 1] : &payload[len]);
+    return true;
+  }
+  return false;
 }
 
-void process_query(char *payload)
+void output_string(char *msg)
 {
-  const char *name;
-  char *args;
+  if (strlen(msg) == 0)
+    return;
 
-  args = strchr(payload, ':');
-  if (args)
-    *args++ = '\0';
-  name = payload;
-  if (!strcmp(name, "C"))
+  write_packet_start();
+  write_packet_str("O");
+  write_packet_hex(msg, strlen(msg));
+  write_packet_end();
+}
+
+/* dprintf output */
+/* Text printed by the printf bytecode while the target is running is queued
+ * and sent to gdb as O packets when the queue fills up or the target stops.
+ * With "monitor dprintf console" it is written to the X68k console instead.
+ */
+bool dprintf_console = false;
+char dprintf_buf[1024];
+size_t dprintf_len;
+
+void dprintf_flush(void)
+{
+  if (dprintf_len == 0)
+    return;
+
+  write_packet_start();
+  write_packet_str("O");
+  write_packet_hex(dprintf_buf, dprintf_len);
+  write_packet_end();
+  dprintf_len = 0;
+}
+
+void agent_output(const char *str)
+{
+  size_t len = strlen(str);
+
+  if (dprintf_console)
   {
-    snprintf(tmpbuf, sizeof(tmpbuf), "QC%x", (current_tid < 0) ? 1 : (current_tid + 1));
-    write_packet(tmpbuf);
+    for (; *str; str++)
+    {
+      if (*str == '\n')
+        _iocs_b_putc('\r');
+      _iocs_b_putc(*str);
+    }
+    return;
   }
-  if (!strcmp(name, "Attached"))
+
+  if (dprintf_len + len > sizeof(dprintf_buf))
   {
-    if (attach)
-      write_packet("1");
-    else
-      write_packet("0");
+    dprintf_flush();
+    write_flush();
   }
-  if (!strcmp(name, "Offsets"))
+  if (len > sizeof(dprintf_buf))
+    len = sizeof(dprintf_buf);
+  memcpy(&dprintf_buf[dprintf_len], str, len);
+  dprintf_len += len;
+}
+
+/* Monitor commands (qRcmd) */
+/* Command output is sent to gdb as O packets */
+void monitor_printf(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(msgbuf, sizeof(msgbuf), fmt, ap);
+  va_end(ap);
+  output_string(msgbuf);
+}
+
+void monitor_bp(char *args)
+{
+  struct breakpoint *bp;
+  monitor_printf("Address   Type  Hits      Ignore    Condition\n");
+  for (int i = 0; (bp = breakpoint_get(i)) != NULL; i++)
   {
-    snprintf(tmpbuf, sizeof(tmpbuf), "Text=%x;Data=%x;Bss=%x",
-             target_offset, target_offset, target_offset);
-    write_packet(tmpbuf);
+    if (!(bp->flags & (BP_WANTED | BP_HW)))
+      continue;
+    monitor_printf("%08x  %-4s  %-8u  %-8u  %s\n", bp->addr,
+                   bp->flags & BP_WANTED ? "sw" : "hw", bp->hit_count,
+                   bp->ignore_count, bp->cond ? "yes" : "no");
   }
-  if (!strcmp(name, "Supported"))
-    write_packet("PacketSize=8000;qXfer:features:read+");
-  if (!strcmp(name, "Symbol"))
-    write_packet("OK");
-  if (name == strstr(name, "ThreadExtraInfo"))
+}
+
+void monitor_ignore(char *args)
+{
+  size_t addr, count;
+  struct breakpoint *bp;
+  if (sscanf(args, "%x %u", &addr, &count) != 2 ||
+      (bp = breakpoint_find(addr)) == NULL || !(bp->flags & (BP_WANTED | BP_HW)))
   {
-    args = payload;
-    args = 1 + strchr(args, ',');
-    int t;
-    sscanf(args, "%x", &t);
-    char *name = "Human68k system";
-    if (current_tid >= 0) {
-      struct dos_prcptr *prc = get_prcptr(t - 1);
-      name = prc->name;
-    }
-    mem2hex(name, tmpbuf, strlen(name));
-    write_packet(tmpbuf);
+    monitor_printf("usage: monitor ignore <breakpoint address> <count>\n");
+    return;
   }
-  if (!strcmp(name, "TStatus"))
-    write_packet("");
-  if (!strcmp(name, "Xfer"))
+  bp->ignore_count = count;
+}
+
+void monitor_dprintf(char *args)
+{
+  if (!strcmp(args, "console"))
+    dprintf_console = true;
+  else if (!strcmp(args, "gdb"))
+    dprintf_console = false;
+  else
+    monitor_printf("dprintf output: %s\n", dprintf_console ? "console" : "gdb");
+}
+
+void monitor_record(char *args)
+{
+  if (!strcmp(args, "on"))
   {
-    name = args;
-    args = strchr(args, ':');
-    *args++ = '\0';
-    return process_xfer(name, args);
+    if (!record_start())
+      monitor_printf("cannot allocate the execution log (%u bytes)\n", record_size);
   }
-  if (!strcmp(name, "fThreadInfo"))
+  else if (!strcmp(args, "off"))
+    record_stop();
+  else
+    monitor_printf("record: %s, %d instructions, %u/%u bytes\n",
+                   record_active() ? "on" : "off", record_count(), record_used(), record_buffer_size());
+}
+
+static int profile_compare(const void *a, const void *b)
+{
+  uint32_t ca = profile_get(*(const uint16_t *)a)->count;
+  uint32_t cb = profile_get(*(const uint16_t *)b)->count;
+  return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/* PC sampling profile */
+/* Each line shows the sampled address, the same address relative to the
+ * ELF file (for symbolizing on the host) and the number of samples.
+ */
+void monitor_profile(char *args)
+{
+  static uint16_t order[PROFILE_SLOTS];
+  int max = 20;
+  int n = 0;
+
+  if (!strcmp(args, "on"))
   {
-    strcpy(tmpbuf, "m");
-    if (current_tid >= 0) {
-      if (main_pi) {
-        snprintf(tmpbuf + 1, sizeof(tmpbuf) - 1, "%x", main_pi->tid + 1);
-        for (pthread_internal_t *pi = main_pi->next; pi; pi = pi->next) {
-          char tid[20];
-          snprintf(tid, sizeof(tid), ",%x", pi->tid + 1);
-          strcat(tmpbuf, tid);
-        }
-      } else {
-        snprintf(tmpbuf + 1, sizeof(tmpbuf) - 1, "%x", current_tid + 1);
+    profile_clear();
+    profile_enabled = true;
+    return;
+  }
+  else if (!strcmp(args, "off"))
+  {
+    profile_enabled = false;
+    return;
+  }
+  else if (!strcmp(args, "clear"))
+  {
+    profile_clear();
+    return;
+  }
+  else if (!strcmp(args, "all"))
+    max = PROFILE_SLOTS;
+  else if (*args)
+    max = strtoul(args, NULL, 10);
+
+  for (int i = 0; i < PROFILE_SLOTS; i++)
+  {
+    if (profile_get(i)->count)
+      order[n++] = i;
+  }
+  qsort(order, n, sizeof(order[0]), profile_compare);
+
+  monitor_printf("profile: %s, %u samples, %u dropped, %d addresses\n",
+                 profile_enabled ? "on" : "off", profile_samples, profile_dropped, n);
+  monitor_printf("Address   ELF       Samples   %%\n");
+  for (int i = 0; i < n && i < max; i++)
+  {
+    const struct profile_entry *e = profile_get(order[i]);
+    uint32_t permille = e->count * 1000 / profile_samples;
+    monitor_printf("%08x  %08x  %-8u  %u.%u\n", e->pc, e->pc - target_offset,
+                   e->count, permille / 10, permille % 10);
+  }
+}
+
+void monitor_coverage(char *args)
+{
+  monitor_printf("coverage: %d/%d blocks hit\n", coverage_hits(), coverage_count());
+}
+
+void monitor_functime(char *args)
+{
+  struct functime *f;
+  monitor_printf("Address   ELF       Calls     Time(ms)\n");
+  for (int i = 0; (f = functime_get(i)) != NULL; i++)
+  {
+    uint32_t us = f->time * PROFILE_TIME_US;
+    monitor_printf("%08x  %08x  %-8u  %u.%03u\n", f->addr, f->addr - target_offset,
+                   f->calls, us / 1000, us % 1000);
+  }
+  if (functime_dropped)
+    monitor_printf("%u calls not timed\n", functime_dropped);
+}
+
+void monitor_help(char *args);
+
+const struct packet_handler monitor_handlers[] = {
+  { "bp",               monitor_bp },
+  { "coverage",         monitor_coverage },
+  { "dprintf",          monitor_dprintf },
+  { "functime",         monitor_functime },
+  { "ignore",           monitor_ignore },
+  { "profile",          monitor_profile },
+  { "record",           monitor_record },
+  { "help",             monitor_help },
+  { NULL, NULL }
+};
+
+void monitor_help(char *args)
+{
+  monitor_printf("Commands:\n"
+                 "  bp                     : list breakpoints with hit/ignore counts\n"
+                 "  coverage               : show the number of basic blocks reached\n"
+                 "  dprintf [console|gdb]  : select where target-side dprintf output goes\n"
+                 "  functime               : show call counts and times of registered functions\n"
+                 "  ignore <addr> <count>  : skip the next <count> hits of a breakpoint\n"
+                 "  profile [on|off|clear] : sample the target PC with the Timer-C interrupt\n"
+                 "  profile [<n>|all]      : show the <n> (default 20) most sampled addresses\n"
+                 "  record [on|off]        : log executed instructions for reverse execution\n");
+}
+
+void query_rcmd(char *args)
+{
+  char cmd[128];
+  size_t len = strlen(args) / 2;
+  if (len >= sizeof(cmd))
+    len = sizeof(cmd) - 1;
+  hex2mem(args, cmd, len);
+  cmd[len] = '\0';
+
+  const struct packet_handler *h;
+  char *arg = cmd + strcspn(cmd, " ");
+  if (*arg)
+    *arg++ = '\0';
+  for (h = monitor_handlers; h->name; h++)
+  {
+    if (!strcmp(cmd, h->name))
+    {
+      h->func(arg);
+      break;
+    }
+  }
+  if (h->name == NULL)
+    monitor_help(arg);
+  write_packet("OK");
+}
+
+/* Thread list cache */
+/* Rebuilt only when the thread chain has changed since it was last built */
+struct thread_list
+{
+  int generation;
+  int num;
+  int tid[32];
+  size_t xml_len;
+  char xml[0x1800];
+} threads = { .generation = -1 };
+
+void update_thread_list(void)
+{
+  if (threads.generation == thread_generation)
+    return;
+  threads.generation = thread_generation;
+
+  threads.num = 0;
+  if (current_tid >= 0) {
+    if (main_pi) {
+      for (pthread_internal_t *pi = main_pi; pi && threads.num < 32; pi = pi->next)
+        threads.tid[threads.num++] = pi->tid;
+    } else {
+      threads.tid[threads.num++] = current_tid;
+    }
+  }
+
+  char *p = threads.xml;
+  char *end = threads.xml + sizeof(threads.xml) - 16;
+  p += sprintf(p, "<?xml version=\"1.0\"?>\n<threads>\n");
+  for (int i = 0; i < threads.num && p < end - 160; i++) {
+    struct dos_prcptr *prc = get_prcptr(threads.tid[i]);
+    p += sprintf(p, "<thread id=\"%x\" name=\"", threads.tid[i] + 1);
+    for (int j = 0; j < sizeof(prc->name) && prc->name[j]; j++) {
+      switch (prc->name[j]) {
+      case '<':  p += sprintf(p, "&lt;");   break;
+      case '>':  p += sprintf(p, "&gt;");   break;
+      case '&':  p += sprintf(p, "&amp;");  break;
+      case '"':  p += sprintf(p, "&quot;"); break;
+      default:   *p++ = prc->name[j];       break;
+      }
+    }
+    p += sprintf(p, "\"/>\n");
+  }
+  p += sprintf(p, "</threads>\n");
+  threads.xml_len = p - threads.xml;
+}
+
+/* Memory map of X68k */
+/* Main RAM, GVRAM/TVRAM and the ROMs, plus the Human68k memory blocks above
+ * the 24-bit address space (high memory of 060turbo, TS-6BE16 etc.) found by
+ * walking the block chain from the target PSP. Free space between two such
+ * blocks is included in the same region.
+ *
+ * The I/O area (0xe80000-0xecffff) and the expansion area after SRAM
+ * (0xed4000-0xefffff) are left out on purpose: gdb treats them as
+ * inaccessible and never reads device registers by itself, for example
+ * while unwinding a corrupt stack. They can still be accessed after
+ * "set mem inaccessible-by-default off" or a "mem" command.
+ */
+#define MEMBLK_MAX      64      // limit of the block chain walk
+#define HIGHMEM_START   0x01000000
+
+char memory_map[1024];
+size_t memory_map_len;
+
+void update_memory_map(void)
+{
+  uint32_t ramsize = *(uint32_t *)0x1c00;   // end of main RAM
+  char *p = memory_map;
+  char *end = memory_map + sizeof(memory_map) - 80;    // room for one region and the end tag
+
+  p += sprintf(p,
+    "<?xml version=\"1.0\"?>\n"
+    "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\""
+    " \"http://sourceware.org/gdb/gdb-memory-map.dtd\">\n"
+    "<memory-map>\n"
+    "<memory type=\"ram\" start=\"0x0\" length=\"0x%x\"/>\n"         // main RAM
+    "<memory type=\"ram\" start=\"0xc00000\" length=\"0x200000\"/>\n"  // GVRAM
+    "<memory type=\"ram\" start=\"0xe00000\" length=\"0x80000\"/>\n"   // TVRAM
+    "<memory type=\"rom\" start=\"0xed0000\" length=\"0x4000\"/>\n"    // SRAM
+    "<memory type=\"rom\" start=\"0xf00000\" length=\"0x100000\"/>\n", // CGROM, IPL/IOCS ROM
+    ramsize);
+
+  // Memory block header: prev, parent, end, next (the PSP follows it)
+  struct dos_psp *psp = target_get_psp();
+  if (psp)
+  {
+    uint32_t *blk = (uint32_t *)((uint8_t *)psp - 0x10);
+    uint32_t start = 0, last = 0;
+    int n;
+    for (n = 0; blk[0] && n < MEMBLK_MAX; n++)
+      blk = (uint32_t *)blk[0];
+    for (n = 0; blk && n < MEMBLK_MAX; n++, blk = (uint32_t *)blk[3])
+    {
+      if ((uint32_t)blk >= HIGHMEM_START && blk[2] > (uint32_t)blk)
+      {
+        if (last == 0)
+          start = (uint32_t)blk;
+        last = blk[2];
+        continue;
       }
+      if (last && p < end)
+        p += sprintf(p, "<memory type=\"ram\" start=\"0x%x\" length=\"0x%x\"/>\n",
+                     start, last - start);
+      last = 0;
     }
-    write_packet(tmpbuf);
+    if (last && p < end)
+      p += sprintf(p, "<memory type=\"ram\" start=\"0x%x\" length=\"0x%x\"/>\n",
+                   start, last - start);
   }
-  if (!strcmp(name, "sThreadInfo"))
+  p += sprintf(p, "</memory-map>\n");
+  memory_map_len = p - memory_map;
+}
+
+/* Reply a part of the object for qXfer:<object>:read:<annex>:<offset>,<length> */
+void write_xfer_reply(const char *data, size_t size, char *args)
+{
+  size_t offset, length;
+  sscanf(args, "%x,%x", &offset, &length);
+  if (offset >= size) {
     write_packet("l");
+    return;
+  }
+  if (length > size - offset)
+    length = size - offset;
+  write_packet_start();
+  write_packet_str(offset + length < size ? "m" : "l");
+  write_packet_binary(data + offset, length);
+  write_packet_end();
 }
 
-void output_string(char *msg)
+void process_xfer(const char *name, char *args)
 {
-  if (strlen(msg) == 0)
+  const char *mode = args;
+  args = strchr(args, ':');
+  if (args == NULL || (args = strchr(args + 1, ':')) == NULL)
+  {
+    write_packet("E00");
     return;
+  }
+  *strchr(mode, ':') = '\0';
+  args++;
 
-  sprintf(tmpbuf, "O");
-  while (*msg) {
-    char hex[8];
-    sprintf(hex, "%02x", *(unsigned char *)msg);
-    strcat(tmpbuf, hex);
-    msg++;
+  if (strcmp(mode, "read"))
+    write_packet("");
+  else if (!strcmp(name, "features"))
+    write_xfer_reply(FEATURE_STR, sizeof(FEATURE_STR) - 1, args);
+  else if (!strcmp(name, "memory-map"))
+  {
+    if (strtoul(args, NULL, 16) == 0)    // rebuild at the first part of the object
+      update_memory_map();
+    write_xfer_reply(memory_map, memory_map_len, args);
+  }
+  else if (!strcmp(name, "threads"))
+  {
+    update_thread_list();
+    write_xfer_reply(threads.xml, threads.xml_len, args);
   }
-  write_packet(tmpbuf);
+  else
+    write_packet("");
 }
 
-void process_vpacket(char *payload)
+void query_current_thread(char *args)
 {
-  const char *name;
-  char *args;
-  args = strchr(payload, ';');
-  if (args)
-    *args++ = '\0';
-  name = payload;
+  write_packet_start();
+  write_packet_printf("QC%x", (current_tid < 0) ? 1 : (current_tid + 1));
+  write_packet_end();
+}
+
+void query_attached(char *args)
+{
+  if (attach)
+    write_packet("1");
+  else
+    write_packet("0");
+}
+
+void query_offsets(char *args)
+{
+  write_packet_start();
+  write_packet_printf("Text=%x;Data=%x;Bss=%x",
+                      target_offset, target_offset, target_offset);
+  write_packet_end();
+}
+
+void query_supported(char *args)
+{
+  write_packet_start();
+  write_packet_printf("PacketSize=%x;", PACKET_BUF_SIZE);
+  write_packet_str("qXfer:features:read+;qXfer:memory-map:read+;qXfer:threads:read+;QStartNoAckMode+;binary-upload+;swbreak+;hwbreak+;ConditionalBreakpoints+;BreakpointCommands+;ConditionalTracepoints+;TraceStateVariables+;tracenz+;ReverseStep+;ReverseContinue+");
+  write_packet_end();
+}
 
-  if (!strcmp("Cont", name))
+void query_symbol(char *args)
+{
+  write_packet("OK");
+}
+
+void query_thread_extra_info(char *args)
+{
+  int t;
+  sscanf(args, "%x", &t);
+  char *name = "Human68k system";
+  if (current_tid >= 0) {
+    struct dos_prcptr *prc = get_prcptr(t - 1);
+    name = prc->name;
+  }
+  write_packet_start();
+  write_packet_hex(name, strlen(name));
+  write_packet_end();
+}
+
+void query_trace_status(char *args)
+{
+  write_packet_start();
+  write_packet_printf("T%d;", trace_status == TRACE_RUNNING);
+  switch (trace_status)
   {
-    if (args[0] == 'c')
+  case TRACE_NOTRUN:
+    write_packet_str("tnotrun:0;");
+    break;
+  case TRACE_STOPPED:
+    write_packet_str("tstop::0;");
+    break;
+  case TRACE_FULL:
+    write_packet_str("tfull:0;");
+    break;
+  case TRACE_PASSCOUNT:
+    write_packet_printf("tpasscount:%x;", trace_stop_tp);
+    break;
+  }
+  write_packet_printf("tframes:%x;tcreated:%x;tfree:%x;tsize:%x;circular:0;disconn:0",
+                      trace_frame_count(), trace_frame_count(),
+                      trace_buffer_size() - trace_buffer_used(), trace_buffer_size());
+  write_packet_end();
+}
+
+void query_trace_variable(char *args)
+{
+  int32_t value;
+  if (!tracepoint_get_variable(strtoul(args, NULL, 16), &value))
+  {
+    write_packet("U");
+    return;
+  }
+  write_packet_start();
+  // gdb reads the value as 64 bits, so negative values are sign-extended
+  write_packet_printf(value < 0 ? "Vffffffff%08x" : "V%x", value);
+  write_packet_end();
+}
+
+/* Tracepoint upload (qTfP/qTsP) */
+/* Each reply carries the definition of a tracepoint or one of its actions. */
+int upload_tp;
+int upload_item;
+
+void write_tracepoint_item(void)
+{
+  struct tracepoint *tp;
+  while ((tp = tracepoint_get(upload_tp)) != NULL)
+  {
+    int item = upload_item++;
+    if (item == 0)
     {
-      int exitcode;
-      int result = ptrace(PTRACE_CONT, 0, &exitcode, msgbuf);
-      select_tid = current_tid;
-      output_string(msgbuf);
-      prepare_resume_reply(tmpbuf, true, result, exitcode);
-      write_packet(tmpbuf);
-    }
-    if (args[0] == 's' || args[0] == 'S' || args[0] == 'C')
+      write_packet_start();
+      write_packet_printf("T%x:%x:%c:%x:%x", tp->num, tp->addr,
+                          tp->enabled ? 'E' : 'D', tp->step, tp->pass);
+      if (tp->cond)
+      {
+        write_packet_printf(":X%x,", tp->cond->len);
+        write_packet_hex(tp->cond->bytes, tp->cond->len);
+      }
+      write_packet_end();
+      return;
+    }
+    if (item == 1)
+    {
+      if (!tp->regmask)
+        continue;
+      write_packet_start();
+      write_packet_printf("A%x:%x:R%x", tp->num, tp->addr, tp->regmask);
+      write_packet_end();
+      return;
+    }
+    item -= 2;
+    if (item < tp->nmem)
     {
-      int exitcode;
-      int result = ptrace(PTRACE_SINGLESTEP, 0, &exitcode, msgbuf);
-      select_tid = current_tid;
-      output_string(msgbuf);
-      prepare_resume_reply(tmpbuf, true, result, exitcode);
-      write_packet(tmpbuf);
+      struct trace_mem *m = &tp->mem[item];
+      write_packet_start();
+      write_packet_printf("A%x:%x:M%x,%x,%x", tp->num, tp->addr,
+                          m->basereg, m->offset, m->len);
+      write_packet_end();
+      return;
     }
+    item -= tp->nmem;
+    struct agent_expr *ax;
+    for (ax = tp->exprs; ax && item > 0; ax = ax->next)
+      item--;
+    if (ax)
+    {
+      write_packet_start();
+      write_packet_printf("A%x:%x:X%x,", tp->num, tp->addr, ax->len);
+      write_packet_hex(ax->bytes, ax->len);
+      write_packet_end();
+      return;
+    }
+    upload_tp++;
+    upload_item = 0;
   }
-  if (!strcmp("Cont?", name))
-    write_packet("vCont;c;C;s;S;");
-  if (!strcmp("Kill", name))
+  write_packet("l");
+}
+
+void query_first_tracepoint(char *args)
+{
+  upload_tp = 0;
+  upload_item = 0;
+  write_tracepoint_item();
+}
+
+void query_subsequent_tracepoint(char *args)
+{
+  write_tracepoint_item();
+}
+
+void query_xfer(char *args)
+{
+  const char *name = args;
+  args = strchr(args, ':');
+  if (args == NULL)
   {
-    ptrace(PTRACE_KILL, 0, 0, 0);
-    write_packet("OK");
-    terminate = true;
+    write_packet("");
+    return;
   }
-  if (!strcmp("MustReplyEmpty", name))
+  *args++ = '\0';
+  process_xfer(name, args);
+}
+
+void query_first_thread_info(char *args)
+{
+  write_packet_start();
+  write_packet_str("m");
+  update_thread_list();
+  for (int i = 0; i < threads.num; i++)
+    write_packet_printf(i ? ",%x" : "%x", threads.tid[i] + 1);
+  write_packet_end();
+}
+
+void query_subsequent_thread_info(char *args)
+{
+  write_packet("l");
+}
+
+/* Coverage bitmap (bit n is set when the n-th registered block was reached) */
+void query_coverage_bitmap(char *args)
+{
+  size_t size;
+  const uint8_t *bitmap = coverage_bitmap(&size);
+  write_packet_start();
+  write_packet_hex(bitmap, size);
+  write_packet_end();
+}
+
+/* Function timing table ("D<dropped>" followed by ";<addr>,<calls>,<time>"...) */
+void query_function_time(char *args)
+{
+  struct functime *f;
+  write_packet_start();
+  write_packet_printf("D%x", functime_dropped);
+  for (int i = 0; (f = functime_get(i)) != NULL; i++)
+    write_packet_printf(";%x,%x,%x", f->addr, f->calls, f->time);
+  write_packet_end();
+}
+
+const struct packet_handler query_handlers[] = {
+  { "C",                query_current_thread },
+  { "CoverageBitmap",   query_coverage_bitmap },
+  { "FunctionTime",     query_function_time },
+  { "Attached",         query_attached },
+  { "Offsets",          query_offsets },
+  { "Rcmd",             query_rcmd },
+  { "Supported",        query_supported },
+  { "Symbol",           query_symbol },
+  { "ThreadExtraInfo",  query_thread_extra_info },
+  { "TStatus",          query_trace_status },
+  { "TV",               query_trace_variable },
+  { "TfP",              query_first_tracepoint },
+  { "TsP",              query_subsequent_tracepoint },
+  { "Xfer",             query_xfer },
+  { "fThreadInfo",      query_first_thread_info },
+  { "sThreadInfo",      query_subsequent_thread_info },
+  { NULL, NULL }
+};
+
+void process_query(char *payload)
+{
+  if (!dispatch_packet(query_handlers, payload))
     write_packet("");
 }
 
-bool set_breakpoint(pid_t tid, size_t addr, size_t length)
+void set_start_noack_mode(char *args)
 {
-  int i;
-  for (i = 0; i < BREAKPOINT_NUMBER; i++)
-    if (breakpoints[i].addr == 0)
-    {
-      size_t data = ptrace(PTRACE_PEEKDATA, tid, (void *)addr, NULL);
-      breakpoints[i].orig_data = data;
-      breakpoints[i].addr = addr;
-      assert(sizeof(break_instr) <= length);
-      memcpy((void *)&data, break_instr, sizeof(break_instr));
-      ptrace(PTRACE_POKEDATA, tid, (void *)addr, (void *)data);
-      break;
-    }
-  if (i == BREAKPOINT_NUMBER)
-    return false;
-  else
-    return true;
+  write_packet("OK");
+  remote_noack();
+}
+
+void set_trace_init(char *args)
+{
+  tracepoint_init();
+  write_packet("OK");
+}
+
+void set_trace_point(char *args)
+{
+  write_packet(tracepoint_define(args) ? "OK" : "E01");
 }
 
-bool remove_breakpoint(pid_t tid, size_t addr, size_t length)
+void set_trace_variable(char *args)
 {
-  int i;
-  for (i = 0; i < BREAKPOINT_NUMBER; i++)
-    if (breakpoints[i].addr == addr)
+  write_packet(tracepoint_variable(args) ? "OK" : "E01");
+}
+
+void set_trace_readonly(char *args)
+{
+  write_packet("OK");     // memory not collected in a frame is read by gdb from the file
+}
+
+void set_trace_start(char *args)
+{
+  write_packet(tracepoint_start() ? "OK" : "E01");
+}
+
+void set_trace_stop(char *args)
+{
+  tracepoint_stop();
+  write_packet("OK");
+}
+
+void set_trace_frame(char *args)
+{
+  uint32_t tpnum;
+  int frame = trace_frame_find(args, &tpnum);
+  if (frame < 0)
+  {
+    write_packet("F-1");
+    return;
+  }
+  write_packet_start();
+  write_packet_printf("F%xT%x", frame, tpnum);
+  write_packet_end();
+}
+
+void set_coverage_init(char *args)
+{
+  coverage_init();
+  write_packet("OK");
+}
+
+void set_coverage_add(char *args)
+{
+  write_packet(coverage_add(args) ? "OK" : "E01");
+}
+
+void set_function_init(char *args)
+{
+  functime_init();
+  write_packet("OK");
+}
+
+void set_function_add(char *args)
+{
+  write_packet(functime_add(args) ? "OK" : "E01");
+}
+
+const struct packet_handler set_handlers[] = {
+  { "CoverageAdd",      set_coverage_add },
+  { "CoverageInit",     set_coverage_init },
+  { "FunctionAdd",      set_function_add },
+  { "FunctionInit",     set_function_init },
+  { "StartNoAckMode",   set_start_noack_mode },
+  { "TDP",              set_trace_point },
+  { "TDV",              set_trace_variable },
+  { "TFrame",           set_trace_frame },
+  { "TStart",           set_trace_start },
+  { "TStop",            set_trace_stop },
+  { "Tinit",            set_trace_init },
+  { "Tro",              set_trace_readonly },
+  { NULL, NULL }
+};
+
+void process_set(char *payload)
+{
+  if (!dispatch_packet(set_handlers, payload))
+    write_packet("");
+}
+
+void vpacket_cont(char *args)
+{
+  write_flush();
+  breakpoint_sync();
+  watchpoint_snapshot();
+
+  if (args[0] == 'c')
+  {
+    int exitcode;
+    int result = ptrace(PTRACE_CONT, 0, &exitcode, msgbuf);
+    select_tid = current_tid;
+    dprintf_flush();
+    output_string(msgbuf);
+    write_resume_reply(result, exitcode);
+  }
+  else if (args[0] == 's' || args[0] == 'S' || args[0] == 'C' || args[0] == 'r')
+  {
+    int exitcode;
+    if (args[0] == 'r')
     {
-      ptrace(PTRACE_POKEDATA, tid, (void *)addr, (void *)breakpoints[i].orig_data);
-      breakpoints[i].addr = 0;
-      break;
+      size_t start, end;
+      sscanf(&args[1], "%x,%x", &start, &end);
+      ptrace(PTRACE_SETSTEPRANGE, 0, (void *)start, (void *)end);
     }
-  if (i == BREAKPOINT_NUMBER)
-    return false;
+    int result = ptrace(PTRACE_SINGLESTEP, 0, &exitcode, msgbuf);
+    select_tid = current_tid;
+    dprintf_flush();
+    output_string(msgbuf);
+    write_resume_reply(result, exitcode);
+  }
   else
-    return true;
+    write_packet("E01");
+}
+
+/* Reverse execution (bs/bc) from the execution log */
+void reverse_resume(char *args)
+{
+  int exitcode;
+  write_flush();
+  watchpoint_snapshot();
+  ptrace(args[0] == 's' ? PTRACE_REVSTEP : PTRACE_REVCONT, 0, &exitcode, NULL);
+  select_tid = current_tid;
+  dprintf_flush();
+  write_resume_reply(0, exitcode);
+}
+
+void vpacket_cont_query(char *args)
+{
+  write_packet("vCont;c;C;s;S;r");
+}
+
+void vpacket_kill(char *args)
+{
+  write_flush();
+  ptrace(PTRACE_KILL, 0, 0, 0);
+  write_packet("OK");
+  terminate = true;
+}
+
+void vpacket_must_reply_empty(char *args)
+{
+  write_packet("");
+}
+
+const struct packet_handler vpacket_handlers[] = {
+  { "Cont",             vpacket_cont },
+  { "Cont?",            vpacket_cont_query },
+  { "Kill",             vpacket_kill },
+  { "MustReplyEmpty",   vpacket_must_reply_empty },
+  { NULL, NULL }
+};
+
+void process_vpacket(char *payload)
+{
+  if (!dispatch_packet(vpacket_handlers, payload))
+    write_packet("");
+}
+
+/* Transfer a memory block with a single PTRACE_IO request */
+/* Returns the number of bytes transferred (errno is set if nothing could be). */
+size_t transfer_memory(int op, size_t addr, void *buf, size_t length)
+{
+  struct ptrace_io_desc piod;
+
+  piod.piod_op = op;
+  piod.piod_offs = (void *)addr;
+  piod.piod_addr = buf;
+  piod.piod_len = length;
+  errno = 0;
+  ptrace(PTRACE_IO, 0, &piod, NULL);
+  return piod.piod_len;
 }
 
-size_t restore_breakpoint(size_t addr, size_t length, size_t data)
+void write_error_reply(int err)
 {
-  for (int i = 0; i < BREAKPOINT_NUMBER; i++)
+  write_packet_start();
+  write_packet_printf("E%02x", err);
+  write_packet_end();
+}
+
+void process_trace_frame_packet(char request, char *payload)
+{
+  size_t n, mlen;
+  switch (request)
   {
-    size_t bp_addr = breakpoints[i].addr;
-    size_t bp_size = sizeof(break_instr);
-    if (bp_addr && bp_addr + bp_size > addr && bp_addr < addr + length)
+  case 'g':
+  case 'p':
+  {
+    uint32_t regs[ARCH_REG_NUM], pc;
+    bool valid = trace_frame_regs(regs, &pc);
+    n = ARCH_REG_NUM;
+    if (request == 'p' && (sscanf(payload, "%x", &n) != 1 || n >= ARCH_REG_NUM))
     {
-      for (size_t j = 0; j < bp_size; j++)
-      {
-        if (bp_addr + j >= addr && bp_addr + j < addr + length)
-          ((uint8_t *)&data)[bp_addr + j - addr] = ((uint8_t *)&breakpoints[i].orig_data)[j];
-      }
+      write_packet("E01");
+      break;
+    }
+    write_packet_start();
+    for (int i = 0; i < ARCH_REG_NUM; i++)
+    {
+      if (request == 'p' && i != n)
+        continue;
+      if (valid)
+        write_packet_hex(&regs[regs_map[i].idx], regs_map[i].size);
+      else if (i == PC)
+        write_packet_hex(&pc, regs_map[i].size);
+      else
+        write_packet_str("xxxxxxxx");     // not collected
     }
+    write_packet_end();
+    break;
+  }
+  case 'm':
+  case 'x':
+  {
+    size_t maddr;
+    sscanf(payload, "%x,%x", &maddr, &mlen);
+    if (mlen > sizeof(membuf))
+      mlen = sizeof(membuf);
+    if (mlen > 0 && (mlen = trace_frame_memory(maddr, membuf, mlen)) == 0)
+    {
+      write_packet("E01");
+      break;
+    }
+    write_packet_start();
+    if (request == 'x')
+    {
+      write_packet_str("b");
+      write_packet_binary(membuf, mlen);
+    }
+    else
+      write_packet_hex(membuf, mlen);
+    write_packet_end();
+    break;
+  }
+  default:
+    write_packet("E01");
   }
-  return data;
 }
 
 void process_packet()
 {
   uint8_t *inbuf = inbuf_get();
   int inbuf_size = inbuf_end();
-  uint8_t *packetend_ptr = (uint8_t *)memchr(inbuf, '#', inbuf_size);
-  int packetend = packetend_ptr - inbuf;
-  assert('$' == inbuf[0]);
-  char request = inbuf[1];
-  char *payload = (char *)&inbuf[2];
-  inbuf[packetend] = '\0';
-
-  uint8_t checksum = 0;
-  for (int i = 1; i < packetend; i++)
-    checksum += inbuf[i];
-  assert(checksum == (hex(inbuf[packetend + 1]) << 4 | hex(inbuf[packetend + 2])));
+  char request = inbuf[0];
+  char *payload = (char *)&inbuf[1];
+
+  /* While a trace frame is selected, registers and memory are read from it */
+  /* and the target state cannot be modified. */
+  if (trace_frame >= 0 && request && strchr("gpmxGPMX", request))
+  {
+    process_trace_frame_packet(request, payload);
+    return;
+  }
 
   switch (request)
   {
   case 'g':
   {
     regs_struct regs;
-    uint8_t regbuf[20];
-    tmpbuf[0] = '\0';
     ptrace(PTRACE_GETREGS, select_tid, NULL, &regs);
+    write_packet_start();
     for (int i = 0; i < ARCH_REG_NUM; i++)
-    {
-      mem2hex((void *)(((size_t *)&regs) + regs_map[i].idx), regbuf, regs_map[i].size);
-      regbuf[regs_map[i].size * 2] = '\0';
-      strcat(tmpbuf, regbuf);
-    }
-    write_packet(tmpbuf);
+      write_packet_hex((void *)(((size_t *)&regs) + regs_map[i].idx), regs_map[i].size);
+    write_packet_end();
     break;
   }
   case 'G':
@@ -298,7 +1054,7 @@ void process_packet()
     regs_struct regs;
     for (int i = 0; i < ARCH_REG_NUM; i++)
     {
-      hex2mem(payload, (void *)(((size_t *)&regs) + regs_map[i].idx), regs_map[i].size * 2);
+      hex2mem(payload, (void *)(((size_t *)&regs) + regs_map[i].idx), regs_map[i].size);
       payload += regs_map[i].size * 2;
     }
     ptrace(PTRACE_SETREGS, select_tid, NULL, &regs);
@@ -313,94 +1069,181 @@ void process_packet()
     write_packet("OK");
     break;
   }
+  case 'p':
+  {
+    size_t n;
+    uint32_t val;
+    sscanf(payload, "%x", &n);
+    if (n >= ARCH_REG_NUM) {
+      write_packet("E01");
+      break;
+    }
+    errno = 0;
+    val = ptrace(PTRACE_PEEKUSER, select_tid, (void *)(regs_map[n].idx * SZ), NULL);
+    if (errno) {
+      write_error_reply(errno);
+      break;
+    }
+    write_packet_start();
+    write_packet_hex(&val, regs_map[n].size);
+    write_packet_end();
+    break;
+  }
+  case 'P':
+  {
+    size_t n;
+    uint32_t val;
+    sscanf(payload, "%x=", &n);
+    if (n >= ARCH_REG_NUM || (payload = strchr(payload, '=')) == NULL) {
+      write_packet("E01");
+      break;
+    }
+    hex2mem(payload + 1, (void *)&val, regs_map[n].size);
+    errno = 0;
+    ptrace(PTRACE_POKEUSER, select_tid, (void *)(regs_map[n].idx * SZ), (void *)val);
+    if (errno)
+      write_error_reply(errno);
+    else
+      write_packet("OK");
+    break;
+  }
   case 'm':
+  case 'x':
   {
-    size_t maddr, mlen, mdata;
+    size_t maddr, mlen;
     sscanf(payload, "%x,%x", &maddr, &mlen);
-    if (mlen * SZ * 2 > 0x20000)
+    if (mlen > sizeof(membuf))
+      mlen = sizeof(membuf);
+    mlen = transfer_memory(PIOD_READ_D, maddr, membuf, mlen);
+    if (errno)
     {
-      puts("Buffer overflow!");
-      exit(-1);
+      write_error_reply(errno);
+      break;
     }
-    for (int i = 0; i < mlen; i += SZ)
+    breakpoint_mask(maddr, membuf, mlen);
+    write_packet_start();
+    if (request == 'x')
     {
-      errno = 0;
-      mdata = ptrace(PTRACE_PEEKDATA, 0, (void *)(maddr + i), NULL);
-      if (errno)
-      {
-        sprintf(tmpbuf, "E%02x", errno);
-        break;
-      }
-      mdata = restore_breakpoint(maddr, sizeof(size_t), mdata);
-      mem2hex((void *)&mdata, tmpbuf + i * 2, (mlen - i >= SZ ? SZ : mlen - i));
+      write_packet_str("b");
+      write_packet_binary(membuf, mlen);
     }
-    tmpbuf[mlen * 2] = '\0';
-    write_packet(tmpbuf);
+    else
+      write_packet_hex(membuf, mlen);
+    write_packet_end();
     break;
   }
   case 'M':
   {
-    size_t maddr, mlen, mdata;
+    size_t maddr, mlen;
     sscanf(payload, "%x,%x", &maddr, &mlen);
     if ((payload = strchr(payload, ':')) == NULL) {
       write_packet("OK");
       break;
     }
     payload++;
-    for (int i = 0; i < mlen; i += SZ)
-    {
-      if (mlen - i >= SZ)
-        hex2mem(payload + i * 2, (void *)&mdata, SZ);
-      else
-      {
-        mdata = ptrace(PTRACE_PEEKDATA, 0, (void *)(maddr + i), NULL);
-        hex2mem(payload + i * 2, (void *)&mdata, mlen - i);
-      }
-      ptrace(PTRACE_POKEDATA, 0, (void *)(maddr + i), (void *)mdata);
+    if (strlen(payload) < mlen * 2) {
+      write_packet("E01");
+      break;
     }
-    write_packet("OK");
+    hex2mem(payload, payload, mlen);    // decode in place
+    breakpoint_lift(maddr, mlen);
+    if (transfer_memory(PIOD_WRITE_D, maddr, payload, mlen) < mlen)
+      write_error_reply(EFAULT);
+    else
+      write_packet("OK");
     break;
   }
+  case 'b':
+    if (payload[0] == 's' || payload[0] == 'c')
+      reverse_resume(payload);
+    else
+      write_packet("");
+    break;
   case 'q':
     process_query(payload);
     break;
+  case 'Q':
+    process_set(payload);
+    break;
   case 'v':
     process_vpacket(payload);
     break;
   case 'X':
   {
-    size_t maddr, mlen, mdata;
-    int new_len;
+    size_t maddr, mlen;
     sscanf(payload, "%x,%x:", &maddr, &mlen);
     if ((payload = strchr(payload, ':')) == NULL) {
       write_packet("OK");
       break;
     }
     payload++;
-    new_len = unescape(payload, (char *)packetend_ptr - payload);
-    assert(new_len == mlen);
-    for (int i = 0; i < mlen; i += SZ)
-    {
-      if (mlen - i >= SZ)
-        memcpy((void *)&mdata, payload + i, SZ);
-      else
-      {
-        mdata = ptrace(PTRACE_PEEKDATA, 0, (void *)(maddr + i), NULL);
-        memcpy((void *)&mdata, payload + i, mlen - i);
-      }
-      ptrace(PTRACE_POKEDATA, 0, (void *)(maddr + i), (void *)mdata);
+    if ((char *)inbuf + inbuf_size - payload != mlen) {
+      write_packet("E01");
+      break;
     }
-    write_packet("OK");
+    breakpoint_lift(maddr, mlen);
+    if (transfer_memory(PIOD_WRITE_D, maddr, payload, mlen) < mlen)
+      write_error_reply(EFAULT);
+    else
+      write_packet("OK");
     break;
   }
   case 'Z':
   {
     size_t type, addr, length;
     sscanf(payload, "%x,%x,%x", &type, &addr, &length);
-    if (type == 0 && sizeof(break_instr))
+    if (type == 0 || type == 1)
     {
-      bool ret = set_breakpoint(0, addr, length);
+      /* Optional condition and command lists: */
+      /* ;X<len>,<bytecode>X<len>,<bytecode>...;cmds:<persist>,X<len>,<bytecode>... */
+      struct agent_expr *cond = NULL, *cmds = NULL, **tail = &cond;
+      char *p = strchr(payload, ';');
+      while (p && *p)
+      {
+        if (*p == ';')
+          p++;
+        if (*p == 'X')
+        {
+          if ((*tail = agent_parse(&p)) == NULL)
+            break;
+          tail = &(*tail)->next;
+        }
+        else if (!strncmp(p, "cmds:", 5))
+        {
+          p += 5;             // commands persisting across disconnection are not supported
+          if (*p)
+            p++;
+          if (*p == ',')
+            p++;
+          tail = &cmds;
+        }
+        else
+          p = strchr(p, ';');
+      }
+      if (p && *p)
+      {
+        agent_free(cond);
+        agent_free(cmds);
+        write_packet("E01");
+        break;
+      }
+      bool ret = breakpoint_insert(addr, type == 1 ? BP_HW : BP_WANTED);
       if (ret)
+      {
+        breakpoint_set_condition(addr, cond);
+        breakpoint_set_commands(addr, cmds);
+        write_packet("OK");
+      }
+      else
+      {
+        agent_free(cond);
+        agent_free(cmds);
+        write_packet("E01");
+      }
+    }
+    else if (type == WP_WRITE || type == WP_ACCESS)
+    {
+      if (watchpoint_insert(type, addr, length))
         write_packet("OK");
       else
         write_packet("E01");
@@ -413,14 +1256,21 @@ void process_packet()
   {
     size_t type, addr, length;
     sscanf(payload, "%x,%x,%x", &type, &addr, &length);
-    if (type == 0)
+    if (type == 0 || type == 1)
     {
-      bool ret = remove_breakpoint(0, addr, length);
+      bool ret = breakpoint_remove(addr, type == 1 ? BP_HW : BP_WANTED);
       if (ret)
         write_packet("OK");
       else
         write_packet("E01");
     }
+    else if (type == WP_WRITE || type == WP_ACCESS)
+    {
+      if (watchpoint_remove(type, addr, length))
+        write_packet("OK");
+      else
+        write_packet("E01");
+    }
     else
       write_packet("");
     break;
@@ -450,8 +1300,6 @@ void process_packet()
   default:
     write_packet("");
   }
-
-  inbuf_erase_head(packetend + 3);
 }
 
 void get_request()
@@ -470,8 +1318,8 @@ void get_request()
       first = false;
     }
     process_packet();
-    write_flush();
   }
+  write_flush();
 }
 
 extern struct dos_comline *_cmdline;
@@ -487,6 +1335,7 @@ static void help(char *argv[])
     "  -s<speed> : set serial speed\n"
     "  -i<mode>  : select interrupt mode (0-2)\n"
     "  -b<addr>  : ELF binary base address\n"
+    "  -r<size>  : record execution for reverse debugging (log size in KB)\n"
     , argv[0]);
   exit(1);
 }
@@ -495,6 +1344,7 @@ int main(int argc, char *argv[])
 {
   int ac;
   char *speed = "";
+  bool record = false;
 
   for (ac = 1; ac < argc; ac++) {
     if (argv[ac][0] == '-') {
@@ -509,6 +1359,11 @@ int main(int argc, char *argv[])
       case 'b':
         target_base = strtol(&argv[ac][2], NULL, 0);
         break;
+      case 'r':
+        if (argv[ac][2])
+          record_size = atoi(&argv[ac][2]) * 1024;
+        record = true;
+        break;
       case 'D':
         debuglevel++;
         break;
@@ -523,6 +1378,9 @@ int main(int argc, char *argv[])
 
   if (target == NULL)
     help(argv);
+  // The execution log is allocated once, before the target is loaded
+  if (record && (record_size == 0 || !record_start()))
+    help(argv);
 
   int p;
   bool f = false;
@@ -543,9 +1401,8 @@ int main(int argc, char *argv[])
   memset(target_cmdline.buffer, 0, sizeof(target_cmdline.buffer));
   memcpy(target_cmdline.buffer, &_cmdline->buffer[p], target_cmdline.len);
 
-  remote_prepare(speed);
-
   _iocs_b_super(0);
+  remote_prepare(speed);
   target_offset = target_load(target, &target_cmdline, NULL) - target_base;
 
   if ((int)target_offset < 0) {
@@ -25,83 +25,100 @@
 #include <assert.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <x68k/dos.h>
 #include <x68k/iocs.h>
 #include "packets.h"
+#include "utils.h"
 
 extern int debuglevel;
 extern int ctrlc;
 
-struct packet_buf
-{
-    uint8_t buf[PACKET_BUF_SIZE];
-    int end;
-} in, out;
-
 int sock_fd;
 
-uint8_t *inbuf_get()
+/* Double-buffered transmit queue */
+/* The writer fills one half while the other half is sent to the SCC.
+ * tx_pump() never waits for the SCC, so it can be called between encoding
+ * steps to overlap serial output with building the next part of the reply.
+ */
+#define TX_BUF_SIZE     0x1000
+
+static struct tx_queue
 {
-    return in.buf;
+    uint8_t buf[2][TX_BUF_SIZE];
+    int len[2];                 // number of bytes in each half
+    int fill;                   // half being filled by the writer
+    int sent;                   // number of bytes sent from the other half
+    unsigned long bytes;        // statistics: total bytes sent
+    unsigned long wait;         // statistics: time blocked in write_flush() (1/100s)
+} tx;
+
+static void tx_pump(void)
+{
+    int drain = tx.fill ^ 1;
+
+    while (tx.sent < tx.len[drain] && _iocs_osns232c())
+        _iocs_out232c(tx.buf[drain][tx.sent++]);
 }
 
-int inbuf_end()
+static int tx_busy(void)
 {
-    return in.end;
+    return tx.sent < tx.len[tx.fill ^ 1];
 }
 
-void pktbuf_insert(struct packet_buf *pkt, const uint8_t *buf, ssize_t len)
+/* Queue the half being filled and start filling the other half */
+static void tx_swap(void)
 {
-    if (pkt->end + len >= sizeof(pkt->buf))
+    if (tx_busy())
     {
-        puts("Packet buffer overflow");
-        exit(-2);
+        int start = _iocs_ontime();
+        while (tx_busy())
+            tx_pump();
+        tx.wait += _iocs_ontime() - start;
     }
-    memcpy(pkt->buf + pkt->end, buf, len);
-    pkt->end += len;
+    tx.bytes += tx.len[tx.fill];
+    tx.fill ^= 1;
+    tx.len[tx.fill] = 0;
+    tx.sent = 0;
+    tx_pump();
 }
 
-void pktbuf_erase_head(struct packet_buf *pkt, ssize_t end)
+/* Keep the transmission going while waiting for something else */
+static void tx_poll(void)
 {
-    memmove(pkt->buf, pkt->buf + end, pkt->end - end);
-    pkt->end -= end;
+    if (!tx_busy() && tx.len[tx.fill] > 0)
+        tx_swap();
+    else
+        tx_pump();
 }
 
-void inbuf_erase_head(ssize_t end)
+void write_flush()
 {
-    pktbuf_erase_head(&in, end);
-}
+    tx_swap();
+    tx_swap();
 
-void pktbuf_clear(struct packet_buf *pkt)
-{
-    pkt->end = 0;
+    if (debuglevel > 1)
+        printf("\n");
 }
 
-void write_flush()
+void write_data_raw(const uint8_t *data, ssize_t len)
 {
-    size_t write_index = 0;
-
     if (debuglevel > 1)
-        printf("\x1b[31m");
+        printf("\x1b[31m%.*s\x1b[m", (int)len, data);
 
-    while (write_index < out.end)
+    while (len > 0)
     {
-        while (_iocs_osns232c() == 0)
-            ;
-        if (debuglevel > 1)
-            putchar(out.buf[write_index]);
-        _iocs_out232c(out.buf[write_index++]);
+        ssize_t n = TX_BUF_SIZE - tx.len[tx.fill];
+        if (n > len)
+            n = len;
+        memcpy(&tx.buf[tx.fill][tx.len[tx.fill]], data, n);
+        tx.len[tx.fill] += n;
+        data += n;
+        len -= n;
+        if (tx.len[tx.fill] == TX_BUF_SIZE)
+            tx_swap();
     }
-
-    if (debuglevel > 1)
-        printf("\x1b[m\n");
-
-    pktbuf_clear(&out);
-}
-
-void write_data_raw(const uint8_t *data, ssize_t len)
-{
-    pktbuf_insert(&out, data, len);
+    tx_poll();
 }
 
 void write_hex(unsigned long hex)
@@ -113,127 +130,420 @@ void write_hex(unsigned long hex)
     write_data_raw((uint8_t *)buf, len);
 }
 
-void write_packet_bytes(const uint8_t *data, size_t num_bytes)
+/* Streaming packet writer */
+/* The payload is checksummed and run-length encoded on the fly and goes
+ * straight into the transmit queue, so replies of any size can be built
+ * piece by piece between write_packet_start() and write_packet_end().
+ *
+ * Run-length encoding: "X*n" stands for X followed by (n - 29) more X's.
+ * Repeat counts that would make n one of '#', '$', '+' or '-' are shortened
+ * and the rest is sent as plain characters.
+ */
+#define RLE_MIN_REPEAT  3
+#define RLE_MAX_REPEAT  (126 - 29)
+
+static struct packet_writer
 {
+    uint8_t buf[256];           // encoded payload waiting for write_data_raw()
+    int len;
     uint8_t checksum;
-    size_t i;
+    int run_char;               // character of the current run (-1: none)
+    int run_rep;                // number of repeats after the first run_char
+} pkt;
+
+static unsigned long rle_raw_bytes;     // statistics: payload bytes before encoding
+static unsigned long rle_enc_bytes;     // statistics: payload bytes after encoding
+
+static inline void pkt_emit(uint8_t c)
+{
+    pkt.buf[pkt.len++] = c;
+    pkt.checksum += c;
+}
 
+/* Encode the current run into the packet */
+static void pkt_flush_run(void)
+{
+    int rep = pkt.run_rep;
+
+    if (pkt.run_char < 0)
+        return;
+
+    if (pkt.len > sizeof(pkt.buf) - 6)
+    {
+        write_data_raw(pkt.buf, pkt.len);
+        rle_enc_bytes += pkt.len;
+        pkt.len = 0;
+    }
+
+    pkt_emit(pkt.run_char);
+    if (rep >= RLE_MIN_REPEAT)
+    {
+        while (rep + 29 == '#' || rep + 29 == '$' || rep + 29 == '+' || rep + 29 == '-')
+            rep--;
+        pkt_emit('*');
+        pkt_emit(rep + 29);
+        rep = pkt.run_rep - rep;
+    }
+    while (rep-- > 0)
+        pkt_emit(pkt.run_char);
+
+    pkt.run_char = -1;
+}
+
+static inline void pkt_put(uint8_t c)
+{
+    if (c == pkt.run_char && pkt.run_rep < RLE_MAX_REPEAT)
+    {
+        pkt.run_rep++;
+        return;
+    }
+    pkt_flush_run();
+    pkt.run_char = c;
+    pkt.run_rep = 0;
+}
+
+void write_packet_start(void)
+{
     write_data_raw((uint8_t *)"$", 1);
-    for (i = 0, checksum = 0; i < num_bytes; ++i)
-        checksum += data[i];
-    write_data_raw((uint8_t *)data, num_bytes);
-    write_data_raw((uint8_t *)"#", 1);
-    write_hex(checksum);
+    pkt.len = 0;
+    pkt.checksum = 0;
+    pkt.run_char = -1;
 }
 
-void write_packet(const char *data)
+void write_packet_data(const void *data, size_t len)
 {
-    write_packet_bytes((const uint8_t *)data, strlen(data));
+    const uint8_t *p = data;
+
+    rle_raw_bytes += len;
+    while (len-- > 0)
+        pkt_put(*p++);
 }
 
-void write_binary_packet(const char *pfx, const uint8_t *data, ssize_t num_bytes)
+void write_packet_str(const char *str)
 {
-    uint8_t *buf;
-    ssize_t pfx_num_chars = strlen(pfx);
-    ssize_t buf_num_bytes = 0;
-    int i;
+    write_packet_data(str, strlen(str));
+}
+
+void write_packet_printf(const char *fmt, ...)
+{
+    char buf[128];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len >= sizeof(buf))
+        len = sizeof(buf) - 1;
+    write_packet_data(buf, len);
+}
 
-    buf = malloc(2 * num_bytes + pfx_num_chars);
-    memcpy(buf, pfx, pfx_num_chars);
-    buf_num_bytes += pfx_num_chars;
+/* Hex-encode data into the packet */
+void write_packet_hex(const void *data, size_t len)
+{
+    const uint8_t *p = data;
 
-    for (i = 0; i < num_bytes; ++i)
+    rle_raw_bytes += len * 2;
+    while (len-- > 0)
     {
-        uint8_t b = data[i];
+        pkt_put(hexchars[*p >> 4]);
+        pkt_put(hexchars[*p & 0xf]);
+        p++;
+    }
+}
+
+/* Escape binary data into the packet */
+void write_packet_binary(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len-- > 0)
+    {
+        uint8_t b = *p++;
         switch (b)
         {
         case '#':
         case '$':
         case '}':
         case '*':
-            buf[buf_num_bytes++] = '}';
-            buf[buf_num_bytes++] = b ^ 0x20;
+            pkt_put('}');
+            pkt_put(b ^ 0x20);
+            rle_raw_bytes += 2;
             break;
         default:
-            buf[buf_num_bytes++] = b;
+            pkt_put(b);
+            rle_raw_bytes++;
             break;
         }
     }
-    write_packet_bytes(buf, buf_num_bytes);
-    free(buf);
 }
 
-static int inp232c(void)
+void write_packet_end(void)
 {
-    int c;
-    uint16_t sr;
-    __asm__ ("move.w %%sr,%0" : "=d"(sr));
+    pkt_flush_run();
+    write_data_raw(pkt.buf, pkt.len);
+    rle_enc_bytes += pkt.len;
 
-    if ((sr & 0x0700) < 0x0500) {           // SCC interrupt enable
-        while (_iocs_isns232c() == 0)
-            ;
-        c = _iocs_inp232c() & 0xff;
-    } else {                                // SCC interrupt disable
-        if (_iocs_isns232c()) {
-            c = _iocs_inp232c() & 0xff;
-        } else {
-            c = *(volatile uint16_t *)0xe98004;         // Ch.A command port (select RR0)
-            do {
-                c = *(volatile uint16_t *)0xe98004;
-            } while (!(c & 1));                         // wait for Rx char available
-            c = *(volatile uint16_t *)0xe98006 & 0xff;  // Ch.A data port
-        }
-    }
+    write_data_raw((uint8_t *)"#", 1);
+    write_hex(pkt.checksum);
+}
 
-    if (debuglevel > 1)
+void write_packet_bytes(const uint8_t *data, size_t num_bytes)
+{
+    write_packet_start();
+    write_packet_data(data, num_bytes);
+    write_packet_end();
+}
+
+void write_packet(const char *data)
+{
+    write_packet_bytes((const uint8_t *)data, strlen(data));
+}
+
+void write_binary_packet(const char *pfx, const uint8_t *data, ssize_t num_bytes)
+{
+    write_packet_start();
+    write_packet_str(pfx);
+    write_packet_binary(data, num_bytes);
+    write_packet_end();
+}
+
+/* SCC Ch.A receive slots */
+/* Packets are parsed as the bytes arrive from the SCC Rx interrupt (or from
+ * polling while the interrupt is masked): the "$...#xx" framing is removed,
+ * '}' escapes are undone and the checksum is verified, so each slot holds
+ * a ready-to-use, NUL terminated payload that is processed in place.
+ * Bytes outside of a frame are discarded except for CTRL+C.
+ */
+#define SCC_A_CMD       (*(volatile uint8_t *)0xe98005)     // Ch.A command port
+#define SCC_A_DATA      (*(volatile uint8_t *)0xe98007)     // Ch.A data port
+
+#define RX_SLOT_NUM     2
+
+enum { RX_IDLE, RX_DATA, RX_ESCAPE, RX_CSUM1, RX_CSUM2, RX_SKIP, RX_SKIP_CSUM1, RX_SKIP_CSUM2 };
+
+static struct rx_slot
+{
+    uint8_t buf[PACKET_BUF_SIZE + 1];
+    int len;
+    bool ok;                            // checksum matched and the packet fit in buf
+} rx_slot[RX_SLOT_NUM];
+
+static struct rx_parser
+{
+    struct rx_slot *slot;               // slot being received
+    int state;
+    uint8_t checksum;                   // checksum of the received bytes
+    uint8_t expected;                   // checksum sent by gdb
+    volatile unsigned int frames_in;    // number of frames completed (interrupt side)
+    volatile unsigned int frames_out;   // number of frames taken (read_packet side)
+    unsigned long dropped;              // statistics: frames skipped for lack of a slot
+} rx;
+
+static struct rx_slot *rx_current;      // slot being processed by gdbserver
+
+static uint32_t sccrx_oldvect;          // SCC Rx interrupt vector before remote_prepare()
+static bool noack = false;              // QStartNoAckMode negotiated
+
+static void rx_byte(uint8_t c)
+{
+    struct rx_slot *slot = rx.slot;
+
+    switch (rx.state)
     {
-        if (c < ' ')
-            printf("{%02X}", c);
-          else
-            printf("%c", c);
-        fflush(stdout);
+    case RX_IDLE:
+        if (c == INTERRUPT_CHAR)
+            ctrlc = true;
+        if (c != '$')
+            break;                      // drop acks and noise between packets
+        if (rx.frames_in - rx.frames_out >= RX_SLOT_NUM)
+        {
+            // No free slot. gdb only has one command outstanding, so this
+            // should not happen. Without acks gdb will not resend it, so
+            // count the drop for the -D statistics.
+            rx.dropped++;
+            rx.state = RX_SKIP;
+            break;
+        }
+        rx.slot = &rx_slot[rx.frames_in % RX_SLOT_NUM];
+        rx.slot->len = 0;
+        rx.slot->ok = true;
+        rx.checksum = 0;
+        rx.state = RX_DATA;
+        break;
+
+    case RX_DATA:
+    case RX_ESCAPE:
+        if (c == '$')                   // resent packet: restart the frame
+        {
+            slot->len = 0;
+            slot->ok = true;
+            rx.checksum = 0;
+            rx.state = RX_DATA;
+            break;
+        }
+        if (c == '#')
+        {
+            rx.state = RX_CSUM1;
+            break;
+        }
+        rx.checksum += c;
+        if (rx.state == RX_DATA && c == '}')
+        {
+            rx.state = RX_ESCAPE;
+            break;
+        }
+        if (rx.state == RX_ESCAPE)
+            c ^= 0x20;
+        rx.state = RX_DATA;
+        if (slot->len < PACKET_BUF_SIZE)
+            slot->buf[slot->len++] = c;
+        else
+            slot->ok = false;           // too long
+        break;
+
+    case RX_CSUM1:
+        rx.expected = hex(c) << 4;
+        rx.state = RX_CSUM2;
+        break;
+
+    case RX_CSUM2:
+        rx.expected |= hex(c);
+        if (rx.expected != rx.checksum)
+            slot->ok = false;
+        slot->buf[slot->len] = '\0';
+        rx.frames_in++;
+        rx.state = RX_IDLE;
+        break;
+
+    case RX_SKIP:
+        if (c == '#')
+            rx.state = RX_SKIP_CSUM1;
+        break;
+    case RX_SKIP_CSUM1:
+        rx.state = RX_SKIP_CSUM2;
+        break;
+    case RX_SKIP_CSUM2:
+        rx.state = RX_IDLE;
+        break;
     }
+}
+
+/* SCC Rx interrupt */
+__attribute__((interrupt))
+static void rx_intr(void)
+{
+    while (SCC_A_CMD & 1)               // Rx char available
+        rx_byte(SCC_A_DATA);
+    SCC_A_CMD = 0x30;                   // error reset
+    SCC_A_CMD = 0x38;                   // reset highest IUS
+}
+
+/* Receive by polling while the SCC interrupt is disabled */
+static void rx_poll(void)
+{
+    uint16_t sr;
+    __asm__ ("move.w %%sr,%0" : "=d"(sr));
 
-    return c;
+    if ((sr & 0x0700) < 0x0500)         // SCC interrupt enable
+        return;
+
+    (void)SCC_A_CMD;                    // select RR0
+    while (SCC_A_CMD & 1)
+        rx_byte(SCC_A_DATA);
+}
+
+uint8_t *inbuf_get()
+{
+    return rx_current->buf;
 }
 
+int inbuf_end()
+{
+    return rx_current->len;
+}
+
+/* Wait for the next packet and make it the current input buffer */
+/* The previous packet's slot is released here, so the payload returned by
+ * inbuf_get() stays valid until the next call.
+ */
 int read_packet(int waitkey)
 {
-    uint8_t c;
-    pktbuf_clear(&in);
-    do {
-        if (waitkey) {
-            do {
+    int i;
+
+    if (rx_current)
+    {
+        rx.frames_out++;
+        rx_current = NULL;
+    }
+
+    while (1)
+    {
+        while (rx.frames_in == rx.frames_out)
+        {
+            if (waitkey)
+            {
                 int key = _iocs_b_keysns();
-                if (key) {
+                if (key)
+                {
                     key = _iocs_b_keyinp();
-                    if (key & 0xff) {
+                    if (key & 0xff)
                         return -1;
-                    }
                 }
-            } while (_iocs_isns232c() == 0);
+            }
+            rx_poll();
+            tx_poll();
         }
 
-        c = inp232c();
-        if (c == INTERRUPT_CHAR) {
-            ctrlc = true;
-            continue;
+        rx_current = &rx_slot[rx.frames_out % RX_SLOT_NUM];
+        if (rx_current->ok)
+            break;
+
+        // bad checksum: ask gdb to resend the packet
+        if (debuglevel > 0)
+            printf("Bad packet received\n");
+        rx.frames_out++;
+        rx_current = NULL;
+        if (!noack)
+            write_data_raw((uint8_t *)"-", 1);
+    }
+
+    if (debuglevel > 1)
+    {
+        printf("$");
+        for (i = 0; i < rx_current->len; i++)
+        {
+            if (rx_current->buf[i] < ' ')
+                printf("{%02X}", rx_current->buf[i]);
+            else
+                printf("%c", rx_current->buf[i]);
         }
-    } while (c != '$');
-
-    pktbuf_insert(&in, &c, 1);
-    do {
-        c = inp232c();
-        pktbuf_insert(&in, &c, 1);
-    } while (c != '#');
-    c = inp232c();
-    pktbuf_insert(&in, &c, 1);
-    c = inp232c();
-    pktbuf_insert(&in, &c, 1);
-
-    write_data_raw((uint8_t *)"+", 1);
-    write_flush();
-    return 0;
+        fflush(stdout);
+    }
+
+    if (!noack)
+        write_data_raw((uint8_t *)"+", 1);
+    return rx_current->len;
+}
+
+void remote_noack(void)
+{
+    noack = true;
+}
+
+static void remote_finish(void)
+{
+    if (debuglevel > 0)
+    {
+        printf("Sent %lu bytes, blocked %lu.%02lus\n",
+               tx.bytes, tx.wait / 100, tx.wait % 100);
+        printf("Payload %lu bytes, run-length encoded to %lu bytes\n",
+               rle_raw_bytes, rle_enc_bytes);
+        printf("Dropped %lu packets (no free receive slot)\n", rx.dropped);
+    }
+
+    *(uint32_t *)0x0170 = sccrx_oldvect;
+    *(uint32_t *)0x0174 = sccrx_oldvect;
 }
 
 void remote_prepare(char *speed)
@@ -254,4 +564,14 @@ void remote_prepare(char *speed)
 
     // stop 1 / nonparity / 8bit / nonxoff
     _iocs_set232c(0x4c00 | bdset);
+
+    // receive by our own SCC Rx interrupt instead of IOCS
+    uint16_t sr;
+    __asm__ volatile ("move.w %%sr,%0\n"
+                      "ori.w #0x0700,%%sr" : "=d"(sr));
+    sccrx_oldvect = *(uint32_t *)0x0170;
+    *(uint32_t *)0x0170 = (uint32_t)rx_intr;
+    *(uint32_t *)0x0174 = (uint32_t)rx_intr;
+    __asm__ volatile ("move.w %0,%%sr" : : "d"(sr));
+    atexit(remote_finish);
 }
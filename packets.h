@@ -20,18 +20,26 @@
 #define PACKETS_H
 
 #include <stdint.h>
+#include <stddef.h>
 
-#define PACKET_BUF_SIZE 0x8000
+#define PACKET_BUF_SIZE 0x10000
 
 static const char INTERRUPT_CHAR = '\x03';
 
 uint8_t *inbuf_get();
 int inbuf_end();
-void inbuf_erase_head(ssize_t end);
 void write_flush();
+void write_packet_start(void);
+void write_packet_data(const void *data, size_t len);
+void write_packet_str(const char *str);
+void write_packet_printf(const char *fmt, ...);
+void write_packet_hex(const void *data, size_t len);
+void write_packet_binary(const void *data, size_t len);
+void write_packet_end(void);
 void write_packet(const char *data);
 void write_binary_packet(const char *pfx, const uint8_t *data, ssize_t num_bytes);
 int read_packet(int waitkey);
 void remote_prepare(char *name);
+void remote_noack(void);
 
 #endif /* PACKETS_H */
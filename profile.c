@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "profile.h"
+
+/* Statistical PC sampling */
+/* While the target runs, the MFP Timer-C interrupt (vector 0x114, every 10ms)
+ * is hooked. The hook records the interrupted PC in a histogram and then
+ * chains to the original handler, so the IOCS timer services keep working.
+ * Samples are lost while the target runs with the interrupt level at 6 or
+ * higher.
+ *
+ * The same hook also counts the Timer-C periods, which profile_time()
+ * combines with the Timer-C data register into a clock of the target
+ * execution time.
+ */
+bool profile_enabled;
+bool profile_clock;
+uint32_t profile_samples;
+uint32_t profile_dropped;
+
+#define PROFILE_VECTOR  0x0114
+#define MFP_IPRB        ((volatile uint8_t *)0xe8800d)
+#define MFP_TCDR        ((volatile uint8_t *)0xe88023)
+#define TIMERC_PENDING  0x20    // Timer-C bit of IPRB
+#define TIMERC_COUNT    200     // Timer-C data set by IOCS (10ms at 20kHz)
+#define PROFILE_PROBE   8       // slots searched before a sample is dropped
+
+static struct profile_entry prof_table[PROFILE_SLOTS];
+uint32_t profile_vect;          // original Timer-C vector while hooked
+static uint32_t prof_periods;   // Timer-C interrupts counted by the hook
+static bool prof_hooked;        // installed by profile_attach()
+static bool prof_stale;         // left in the chain of a handler installed by the target
+
+void profile_clear(void)
+{
+  memset(prof_table, 0, sizeof(prof_table));
+  profile_samples = 0;
+  profile_dropped = 0;
+}
+
+const struct profile_entry *profile_get(int index)
+{
+  if (index < 0 || index >= PROFILE_SLOTS)
+    return NULL;
+  return &prof_table[index];
+}
+
+/* Count one sample (called from the interrupt hook) */
+/* The hash avoids multiplication, which is a libgcc call on the 68000. */
+__attribute__((used))
+static void profile_sample(uint32_t pc)
+{
+  unsigned int h = (pc >> 1) ^ (pc >> 11);
+
+  prof_periods++;
+  if (!profile_enabled)
+    return;
+  profile_samples++;
+  for (int i = 0; i < PROFILE_PROBE; i++) {
+    struct profile_entry *e = &prof_table[(h + i) & (PROFILE_SLOTS - 1)];
+    if (e->pc == pc && e->count) {
+      e->count++;
+      return;
+    }
+    if (e->count == 0) {
+      e->pc = pc;
+      e->count = 1;
+      return;
+    }
+  }
+  profile_dropped++;
+}
+
+/* Timer-C interrupt hook */
+/* Passes the stacked PC to profile_sample(), then pushes the original vector
+ * so that the rts at the end of the function jumps to it with the interrupt
+ * frame intact.
+ */
+__attribute__((noinline))
+static void profile_intr(void)
+{
+  __asm__ volatile(
+    "movem.l %d0-%d1/%a0-%a1,%sp@-\n"
+    "move.l %sp@(16+2),%sp@-\n"   // PC of the interrupt frame
+    "jbsr profile_sample\n"
+    "addq.l #4,%sp\n"
+    "movem.l %sp@+,%d0-%d1/%a0-%a1\n"
+    "move.l profile_vect,%sp@-\n"
+  );
+}
+
+/* Install the hook before the target is resumed */
+/* If the target has installed its own Timer-C handler over the hook, that
+ * handler chains to the hook, so the hook must not be installed again in
+ * front of it (the two would call each other forever). It stays reachable
+ * through the target's handler until the target puts it back on exit.
+ */
+void profile_attach(void)
+{
+  uint32_t vect = *(uint32_t *)PROFILE_VECTOR;
+
+  if (!profile_enabled && !profile_clock)
+    return;
+  if (vect == (uint32_t)profile_intr) {
+    prof_stale = false;         // restored by the target
+  } else {
+    if (prof_stale)
+      return;
+    profile_vect = vect;
+    *(uint32_t *)PROFILE_VECTOR = (uint32_t)profile_intr;
+  }
+  prof_hooked = true;
+}
+
+/* Remove the hook after the target has stopped */
+/* The vector is also put back when the hook was not installed by the last
+ * profile_attach(), but the target has restored it to the hook in the
+ * meantime (on exit, or while profiling is off), so that it never points
+ * into gdbserver once gdbserver has exited.
+ */
+void profile_detach(void)
+{
+  if (*(uint32_t *)PROFILE_VECTOR == (uint32_t)profile_intr) {
+    *(uint32_t *)PROFILE_VECTOR = profile_vect;
+    prof_stale = false;
+  } else if (prof_hooked) {
+    prof_stale = true;      // the target has replaced the vector in the meantime
+  }
+  prof_hooked = false;
+}
+
+/* Target execution time in PROFILE_TIME_US units */
+/* Called in the target context with interrupts disabled, so an expired
+ * Timer-C period may still be pending and not yet counted by the hook.
+ * Apart from the current period, time while the target is stopped by gdb
+ * is not counted.
+ */
+uint32_t profile_time(void)
+{
+  uint8_t pending, count;
+
+  do {
+    pending = *MFP_IPRB & TIMERC_PENDING;
+    count = *MFP_TCDR;
+  } while (pending != (*MFP_IPRB & TIMERC_PENDING));
+
+  return (prof_periods + (pending ? 1 : 0)) * TIMERC_COUNT + (TIMERC_COUNT - count);
+}
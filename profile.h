@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PROFILE_SLOTS   1024    // histogram entries (power of 2)
+
+struct profile_entry
+{
+  uint32_t pc;
+  uint32_t count;               // 0: unused slot
+};
+
+/* Resolution of profile_time() (Timer-C runs at 4MHz / 200) */
+#define PROFILE_TIME_US 50
+
+extern bool profile_enabled;
+extern bool profile_clock;              // count Timer-C periods for profile_time()
+extern uint32_t profile_samples;        // total number of samples
+extern uint32_t profile_dropped;        // samples lost because the histogram is full
+
+void profile_clear(void);
+void profile_attach(void);
+void profile_detach(void);
+uint32_t profile_time(void);
+const struct profile_entry *profile_get(int index);
+
+#endif /* PROFILE_H */
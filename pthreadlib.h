@@ -40,5 +40,6 @@ typedef struct pthread_internal {
 
 extern int current_tid;
 extern pthread_internal_t *main_pi;
+extern int thread_generation;
 
 #endif /* PTHREADLIB_H */
@@ -25,6 +25,12 @@
 #include <x68k/iocs.h>
 #include "ptrace.h"
 #include "pthreadlib.h"
+#include "breakpoint.h"
+#include "tracepoint.h"
+#include "record.h"
+#include "profile.h"
+#include "coverage.h"
+#include "functime.h"
 
 extern int debuglevel;
 extern int intrmode;
@@ -37,11 +43,14 @@ extern int ctrlc;
 static uint32_t ustack[1024];       // user stack
 static uint32_t sstack[1024];       // supervisor stack
 static struct pt_regs target_regs;  // デバッグ対象アプリのレジスタ
+static struct ptrace_siginfo target_siginfo;  // デバッグ対象アプリの停止要因
 static struct dos_psp *target_psp;  // デバッグ対象アプリのプロセス管理ポインタ
 static volatile uint8_t intarget = false; // デバッグ対象アプリを実行中か
 
 int current_tid = -1;               // 現在実行中のスレッドID
 pthread_internal_t *main_pi = NULL; // マルチスレッドアプリの場合のメインスレッド内部構造体
+int thread_generation = 0;          // スレッド一覧が変化するたびに更新される世代番号
+static uint32_t thread_sig = 0;     // スレッド一覧の変化検出用
 
 /* gdbserver本体のコンテキスト */
 
@@ -227,9 +236,12 @@ static void suspend_thread(void)
 
   // スレッドデバッグ中に他スレッドが動かないようにするため、
   // 同一プロセス内の自分以外の全スレッドの状態を保存して一時停止する
+  // 併せてスレッド一覧が前回の停止時から変化したかどうかを調べる
   pthread_internal_t *pi;
   int i = 0;
+  uint32_t sig = main_pi ? 0 : current_tid + 1;
   for (pi = main_pi; pi; pi = pi->next, i++) {
+    sig = sig * 31 + (uint32_t)pi + pi->tid;
     if (pi->tid == current_tid) {
       continue;   // 自分自身の状態は変更しない
     }
@@ -242,6 +254,10 @@ static void suspend_thread(void)
     prc->wait_flg = 0xff;
     prc->wait_time = 0;
   }
+  if (sig != thread_sig) {
+    thread_sig = sig;
+    thread_generation++;
+  }
 }
 
 /* スレッドの再開時に他のスレッドの実行を再開する */
@@ -305,32 +321,22 @@ static void sccrx_intr(void)
 }
 
 /* デバッグ対象実行中に使われるSCC Rx割り込み後処理 */
-/* シリアルポートの入力データをチェックし、CTRL+Cだったら
+/* 本来の受信処理(packets.cのrx_intr())がCTRL+Cを受信していたら
  * デバッグ対象をSIGINTで停止させる
  */
 __attribute__((interrupt, used))
 static void sccrx_intr_after(void)
 {
   __asm__ volatile(
-    "move.l %d0,%sp@-\n"
-
-    "moveq.l #0x33,%d0\n"
-    "trap #15\n"                // IOCS _ISNS232C
-    "tst.l %d0\n"
+    "tst.l ctrlc\n"
     "beq 9f\n"
-
-    "moveq.l #0x32,%d0\n"
-    "trap #15\n"                // IOCS _INP232C
-    "cmpi.b #0x03,%d0\n"
-    "bne 9f\n"
+    "clr.l ctrlc\n"
 
     // CTRL+Cを示すベクタ番号(0)をスタックに積んでcommon_trapへジャンプする
-    "move.l %sp@+,%d0\n"
     "clr.w %sp@-\n"
     "bra common_trap\n"
 
     "9:\n"
-    "movem.l %sp@+,%d0\n"
   );
 }
 
@@ -375,6 +381,7 @@ static int frame_m680x0_fixup[] = {
 static int decode_trap(int trapvect, char *msg)
 {
   int res = 0;
+  int code = 0;
   *msg = '\0';
 
   if (debuglevel > 0) {
@@ -391,7 +398,7 @@ static int decode_trap(int trapvect, char *msg)
 
   /* スタックフレームに積まれたSR,PCを引き上げる */
   struct frame_m68000_excep *fe = (struct frame_m68000_excep *)target_regs.ssp;
-  target_regs.sr = fe->sr & 0x7fff;
+  target_regs.sr = fe->sr & 0x3fff;   // トレースビット(T1,T0)をクリア
   target_regs.pc = fe->pc;
   if (debuglevel > 0) {
     if (trapvect != 0x08 && trapvect != 0x0c)
@@ -404,7 +411,7 @@ static int decode_trap(int trapvect, char *msg)
     if (*(uint8_t *)0xcbc == 0) {     // 68000
       struct frame_m68000_buserr *fp = (struct frame_m68000_buserr *)target_regs.ssp;
       target_regs.ssp += sizeof(*fp);
-      target_regs.sr = fp->sr & 0x7fff;
+      target_regs.sr = fp->sr & 0x3fff;
       target_regs.pc = fp->pc;
       sprintf(msg, "%s error by %s memory access of 0x%08x.",
               trapvect == 0x08 ? "Bus" : "Address",
@@ -470,10 +477,13 @@ static int decode_trap(int trapvect, char *msg)
 
   case 0xa4:          // Trap #9 instruction
     target_regs.pc -= 2;
+    code = TRAP_BRKPT;
     /* fall through */
   case 0x24:          // Trace
     target_regs.ssp += sizeof(struct frame_m68000_excep);
     res = 5;          // SIGTRAP
+    if (code == 0)
+      code = TRAP_TRACE;
     if (ctrlc) {            // ステップ実行中にCTRL+Cを受信したらSIGINTを返す
       res = 2;        // SIGINT
       ctrlc = false;
@@ -486,6 +496,9 @@ static int decode_trap(int trapvect, char *msg)
     target_regs.ssp += frame_m680x0_fixup[type] - sizeof(struct frame_m68000_excep);
   }
 
+  target_siginfo.si_signo = res;
+  target_siginfo.si_code = res == 5 ? code : 0;
+  target_siginfo.si_addr = (void *)target_regs.pc;
   return res;
 }
 
@@ -536,7 +549,7 @@ static int do_singlestep(void)
     "1:\n"
     "move.l %a0@(68),%sp@-\n"     // restore pc
     "move.w %a0@(66),%d0\n"
-    "ori.w #0x8000,%d0\n"         // enable TRACE bit
+    "or.w trace_bits,%d0\n"       // enable TRACE bit (T1 or T0)
     "move.w %d0,%sp@-\n"          // restore sr
     "movem.l %a0@,%d0-%d7/%a0-%a6\n"
     "rte\n"
@@ -544,21 +557,94 @@ static int do_singlestep(void)
 }
 
 /* SRの実行モードを見てA7にUSP or SSPを設定する */
-static void update_sp(void)
+static void update_sp(struct pt_regs *regs)
 {
-  if (target_regs.sr & 0x2000)
-    target_regs.a[7] = target_regs.ssp;   // Supervisor stack
+  if (regs->sr & 0x2000)
+    regs->a[7] = regs->ssp;   // Supervisor stack
   else
-    target_regs.a[7] = target_regs.usp;   // User stack
+    regs->a[7] = regs->usp;   // User stack
 }
 
 /* SRの実行モードを見てA7をUSP or SSPに設定する */
-static void retrieve_sp(void)
+static void retrieve_sp(struct pt_regs *regs)
 {
-  if (target_regs.sr & 0x2000)
-    target_regs.ssp = target_regs.a[7];   // Supervisor stack
+  if (regs->sr & 0x2000)
+    regs->ssp = regs->a[7];   // Supervisor stack
   else
-    target_regs.usp = target_regs.a[7];   // User stack
+    regs->usp = regs->a[7];   // User stack
+}
+
+/****************************************************************************/
+
+/* 現在実行中以外のスレッドのレジスタキャッシュ */
+/* スレッド管理構造体からは最初にアクセスされた時点で読み込み、
+ * 変更はデバッグ対象の実行を再開する時にまとめて書き戻す
+ */
+#define N_REGCACHE    32
+static struct pt_regs thread_regs[N_REGCACHE];
+static uint32_t regcache_valid;     // bit n: スレッドID nのレジスタを読み込み済み
+static uint32_t regcache_dirty;     // bit n: スレッドID nのレジスタが変更されている
+
+/* 指定スレッドのレジスタ値を得る */
+static struct pt_regs *get_thread_regs(int tid)
+{
+  if (current_tid < 0 || tid == current_tid) {
+    // 対象が現在実行中のスレッドならgdbserverが保存したレジスタ値を使う
+    update_sp(&target_regs);
+    return &target_regs;
+  }
+  if (tid < 0 || tid >= N_REGCACHE) {
+    return NULL;
+  }
+
+  struct pt_regs *regs = &thread_regs[tid];
+  if (!(regcache_valid & (1 << tid))) {
+    // 他のスレッドならスレッド管理構造体から値を得る
+    struct dos_prcptr *prc = get_prcptr(tid);
+    memcpy(regs->d, prc->d_reg, sizeof(prc->d_reg));
+    memcpy(regs->a, prc->a_reg, sizeof(prc->a_reg));
+    regs->sr = prc->sr_reg;
+    regs->pc = prc->pc_reg;
+    regs->usp = prc->usp_reg;
+    regs->ssp = prc->ssp_reg;
+    update_sp(regs);
+    regcache_valid |= (1 << tid);
+  }
+  return regs;
+}
+
+/* 指定スレッドのレジスタ値を変更したことを記録する */
+/* A7を変更した場合はSRの実行モードに応じてUSP or SSPに反映する */
+static void set_thread_regs_dirty(int tid, bool sp_changed)
+{
+  struct pt_regs *regs = &target_regs;
+  if (current_tid >= 0 && tid != current_tid) {
+    regs = &thread_regs[tid];
+    regcache_dirty |= (1 << tid);
+  }
+  if (sp_changed) {
+    retrieve_sp(regs);
+  }
+}
+
+/* 変更されたレジスタ値をスレッド管理構造体に書き戻してキャッシュを破棄する */
+static void flush_regcache(void)
+{
+  for (int tid = 0; regcache_dirty; tid++) {
+    if (!(regcache_dirty & (1 << tid))) {
+      continue;
+    }
+    struct pt_regs *regs = &thread_regs[tid];
+    struct dos_prcptr *prc = get_prcptr(tid);
+    memcpy(prc->d_reg, regs->d, sizeof(prc->d_reg));
+    memcpy(prc->a_reg, regs->a, sizeof(prc->a_reg));
+    prc->sr_reg = regs->sr;
+    prc->pc_reg = regs->pc;
+    prc->usp_reg = regs->usp;
+    prc->ssp_reg = regs->ssp;
+    regcache_dirty &= ~(1 << tid);
+  }
+  regcache_valid = 0;
 }
 
 /* メモリのread/write (バスエラーチェックつき) */
@@ -614,11 +700,352 @@ static int memory_rw(void *addr, void *datap, int size, int rw)
   );
 }
 
+/* メモリのブロック転送 (バスエラーチェックつき) の1チャンク分 */
+/* 例外ベクタの差し替えは1チャンクにつき1度だけ行い、転送元・転送先が
+ * 偶数アドレスならmovem.lで32バイトずつ転送する。
+ * バスエラーが起きたらその位置からロングワード単位、さらにバイト単位で
+ * 転送し直すことで、転送できなかったバイト位置を正確に求める
+ * in:  dst = 転送先アドレス
+ *      src = 転送元アドレス
+ *      len = 転送バイト数
+ * out: 転送できたバイト数
+*/
+static size_t memory_copy_chunk(void *dst, const void *src, size_t len)
+{
+  size_t rest = len;
+  int phase;
+  __asm__ volatile(
+    "move.w %%sr,%%sp@-\n"
+    "ori.w #0x0700,%%sr\n"        // disable interrupt
+    "move.l 0x0008.w,%%sp@-\n"    // save bus error vector
+    "move.l 0x000c.w,%%sp@-\n"    // save address error vector
+    "movea.l %%sp,%%a2\n"
+    "move.l #8f,0x0008.w\n"
+    "move.l #8f,0x000c.w\n"
+
+    "move.l %[s],%%d0\n"
+    "move.l %[d],%%d2\n"
+    "or.l %%d2,%%d0\n"
+    "btst #0,%%d0\n"
+    "bne 5f\n"                    // odd address: byte access only
+
+    "moveq.l #0,%[ph]\n"          // phase 0: 32 bytes by movem.l
+    "1:\n"
+    "moveq.l #32,%%d0\n"
+    "cmp.l %%d0,%[n]\n"
+    "bcs 3f\n"
+    "movem.l %[s]@,%%d0/%%d2-%%d6/%%a3-%%a4\n"
+    "movem.l %%d0/%%d2-%%d6/%%a3-%%a4,%[d]@\n"
+    "lea.l %[s]@(32),%[s]\n"
+    "lea.l %[d]@(32),%[d]\n"
+    "moveq.l #32,%%d0\n"
+    "sub.l %%d0,%[n]\n"
+    "bra 1b\n"
+
+    "3:\n"
+    "moveq.l #1,%[ph]\n"          // phase 1: long word
+    "4:\n"
+    "moveq.l #4,%%d0\n"
+    "cmp.l %%d0,%[n]\n"
+    "bcs 5f\n"
+    "move.l %[s]@,%[d]@\n"
+    "addq.l #4,%[s]\n"
+    "addq.l #4,%[d]\n"
+    "subq.l #4,%[n]\n"
+    "bra 4b\n"
+
+    "5:\n"
+    "moveq.l #2,%[ph]\n"          // phase 2: byte
+    "6:\n"
+    "tst.l %[n]\n"
+    "beq 9f\n"
+    "move.b %[s]@,%[d]@\n"
+    "addq.l #1,%[s]\n"
+    "addq.l #1,%[d]\n"
+    "subq.l #1,%[n]\n"
+    "bra 6b\n"
+
+    "8:\n"                        // bus error
+    "movea.l %%a2,%%sp\n"
+    "tst.l %[ph]\n"
+    "beq 3b\n"                    // retry from the faulted position by long word
+    "subq.l #1,%[ph]\n"
+    "beq 5b\n"                    // retry from the faulted position by byte
+
+    "9:\n"
+    "move.l %%sp@+,0x000c.w\n"    // restore address error vector
+    "move.l %%sp@+,0x0008.w\n"    // restore bus error vector
+    "move.w %%sp@+,%%sr\n"        // restore interrupt
+    : [s]"+a"(src), [d]"+a"(dst), [n]"+d"(rest), [ph]"=&d"(phase)
+    :
+    : "%%d0", "%%d2", "%%d3", "%%d4", "%%d5", "%%d6", "%%a2", "%%a3", "%%a4", "memory"
+  );
+  return len - rest;
+}
+
+/* 割り込み禁止のまま転送する最大バイト数 */
+/* 10MHzの68000で1ms程度に収まるようにして、タイマやSCC受信の割り込みを
+ * 長時間待たせないようにする
+ */
+#define MEMORY_COPY_CHUNK   1024
+
+/* メモリのブロック転送 (バスエラーチェックつき) */
+/* チャンクごとに割り込み禁止状態を元に戻しながら転送する
+ * out: 転送できたバイト数
+ */
+static size_t memory_copy(void *dst, const void *src, size_t len)
+{
+  size_t done = 0;
+
+  while (done < len) {
+    size_t n = len - done < MEMORY_COPY_CHUNK ? len - done : MEMORY_COPY_CHUNK;
+    size_t copied = memory_copy_chunk(dst + done, src + done, n);
+    done += copied;
+    if (copied < n)
+      break;        // バスエラー
+  }
+  return done;
+}
+
 /****************************************************************************/
 
+/* ステップ実行の範囲 (PTRACE_SETSTEPRANGE) */
+static uint32_t step_start;
+static uint32_t step_end;
+
+/* 次の実行再開時にPCにあるブレークポイントを越えてから実行するか */
+/* gdbがブレークポイントを挿入したまま実行を再開した場合と、条件不成立で
+ * 実行を続ける場合に設定する
+ */
+static bool step_over;
+
+/* do_singlestep()でSRに設定するトレースビット */
+__attribute__((used))
+static uint16_t trace_bits;
+
+#define TRACE_T1      0x8000    // 1命令ごとにトレース
+#define TRACE_T0      0x4000    // 分岐命令でのみトレース (68020～68040)
+
+/* Z1ブレークポイントの手前でT0からT1に切り替える距離 */
+/* T0ではフロー変化でしかPCを調べられないので、分岐先からこの範囲内に
+ * Z1ブレークポイントがあれば1命令ずつトレースして通過を検出する
+ * 分岐先から分岐せずにこの範囲を越えて到達するZ1ブレークポイントは検出できない
+ */
+#define HWBREAK_WINDOW  0x1000
+
+/* 実行再開時のトレースモードを決める (0ならトレースしない) */
+static uint16_t trace_mode(int request)
+{
+  if (request == PTRACE_SINGLESTEP)
+    return TRACE_T1;
+  if (request != PTRACE_CONT)
+    return 0;
+
+  // 記録モードでは1命令ずつトレース実行して実行履歴を残す
+  if (record_active())
+    return TRACE_T1;
+
+  // ウォッチポイントがあれば1命令ずつトレース実行して値の変化を調べる
+  if (watchpoint_active())
+    return TRACE_T1;
+
+  // Z1ブレークポイントがあればトレース実行してPCを調べる
+  if (breakpoint_hw_active()) {
+    uint8_t cpu = *(uint8_t *)0xcbc;
+    if (cpu >= 2 && cpu <= 4 &&
+        !breakpoint_hw_ahead(target_regs.pc, HWBREAK_WINDOW))
+      return TRACE_T0;
+    return TRACE_T1;    // 68000/68010/68060はT0トレースがない
+  }
+  return 0;
+}
+
+/* ステップ実行で1命令として越えるシステムコール命令か */
+/* DOSコール(Fライン命令 0xffxx)やIOCSコール(trap #15)をトレースすると
+ * Human68kやROMの中まで追いかけることになるので、次の命令に一時ブレークポイントを
+ * 置いて通常実行で越える
+ */
+static bool is_syscall_insn(uint32_t pc)
+{
+  struct breakpoint *bp = breakpoint_find(pc);
+  uint16_t insn;
+
+  if (bp && (bp->flags & BP_INSERTED))
+    insn = bp->orig_insn;
+  else if (memory_copy(&insn, (void *)pc, 2) != 2)
+    return false;
+  return (insn & 0xff00) == 0xff00 || insn == 0x4e4f;
+}
+
+/* システムコール命令を1命令として実行する */
+/* 一時ブレークポイントが置けなければ(ROM上など) -2 を返し、通常のステップ実行に任せる
+ * 実行中に他のスレッドが同じ一時ブレークポイントに到達したら、そのスレッドに
+ * ブレークポイントを越えさせて元のスレッドの到達を待ち続ける
+ */
+static int step_syscall(char *msg, int *signo)
+{
+  uint32_t start = target_regs.pc;
+  uint32_t next = target_regs.pc + 2;
+  int tid = PRC_TABLE ? get_current_tid() : 0;
+  int result;
+
+  if (!breakpoint_insert(next, BP_INTERNAL))
+    return -2;
+  breakpoint_sync();
+  if (!(breakpoint_find(next)->flags & BP_INSERTED)) {
+    breakpoint_remove(next, BP_INTERNAL);
+    return -2;
+  }
+
+  step_over = false;
+  breakpoint_lift(start, 2);
+  flash_icache();
+  for (;;) {
+    trace_bits = 0;
+    result = do_cont();
+    if (result < 0)
+      break;
+    *signo = decode_trap(result, msg);
+    if (result != 0xa4 || *signo != 5 || target_regs.pc != next ||
+        (PRC_TABLE ? get_current_tid() : 0) == tid)
+      break;
+    // 他のスレッドが一時ブレークポイントに到達したので1命令実行して越えさせる
+    breakpoint_lift(next, 2);
+    flash_icache();
+    trace_bits = TRACE_T1;
+    result = do_singlestep();
+    breakpoint_sync();
+    breakpoint_lift(start, 2);
+    flash_icache();
+    if (result < 0)
+      break;
+    *signo = decode_trap(result, msg);
+    if (result != 0x24 || *signo != 5)
+      break;
+  }
+  record_reset();         // システムコールの中の変更は記録できない
+  breakpoint_remove(next, BP_INTERNAL);
+  if (result < 0)
+    return result;
+  breakpoint_sync();
+  flash_icache();
+
+  if (result == 0xa4 && *signo == 5 && target_regs.pc == next) {
+    // 一時ブレークポイントへの到達は1命令のステップ実行完了として報告する
+    target_siginfo.si_code = TRAP_TRACE;
+    return 0x24;
+  }
+  return result;
+}
+
+/* デバッグ対象の実行を再開する */
+/* 例外が発生したらdecode_trap()で後処理をしてシグナル番号をsignoに返す */
+static int run_target(int request, char *msg, int *signo)
+{
+  int result;
+
+  if (request == PTRACE_SINGLESTEP && is_syscall_insn(target_regs.pc)) {
+    result = step_syscall(msg, signo);
+    if (result != -2)
+      return result;
+  }
+
+  if (step_over) {
+    // ブレークポイントを一時的に元の命令に戻して1命令だけ実行する
+    step_over = false;
+    breakpoint_lift(target_regs.pc, 2);
+    flash_icache();
+    trace_bits = TRACE_T1;
+    if (record_active())
+      record_begin(&target_regs);
+    result = do_singlestep();
+    breakpoint_sync();
+    flash_icache();
+    if (result < 0) {
+      record_end(&target_regs, false);
+      return result;
+    }
+    *signo = decode_trap(result, msg);
+    record_end(&target_regs, result == 0x24);
+    if (request == PTRACE_SINGLESTEP || result != 0x24 || *signo != 5 || trace_mode(request))
+      return result;
+  }
+
+  trace_bits = trace_mode(request);
+  if (trace_bits == TRACE_T1 && record_active())
+    record_begin(&target_regs);
+  result = trace_bits ? do_singlestep() : do_cont();
+  if (result >= 0)
+    *signo = decode_trap(result, msg);
+  record_end(&target_regs, result == 0x24);
+  return result;
+}
+
+/* デバッグ対象が停止した時、gdbに報告せずにそのまま実行を続けるかどうか */
+static bool resume_again(int request, int result, int signo)
+{
+  if (signo != 5)
+    return false;
+
+  if (result == 0x24) {
+    // ウォッチポイントの監視範囲の値が変化していたら停止する
+    if (watchpoint_active()) {
+      struct watchpoint *wp = watchpoint_check();
+      if (wp) {
+        target_siginfo.si_code = TRAP_WATCHPT;
+        target_siginfo.si_addr = (void *)wp->addr;
+        return false;
+      }
+    }
+
+    if (request == PTRACE_CONT) {
+      // Z1ブレークポイントに到達して条件が成立していれば停止する
+      if (breakpoint_hw_active() && breakpoint_stop(target_regs.pc, BP_HW)) {
+        target_siginfo.si_code = TRAP_HWBKPT;
+        return false;
+      }
+      return true;
+    }
+
+    // 範囲ステップ実行中にPCが範囲内に留まっていればステップ実行を続ける
+    if (request == PTRACE_SINGLESTEP) {
+      if (target_regs.pc >= step_start && target_regs.pc < step_end)
+        return true;
+    }
+  }
+
+  // カバレッジ計測や関数の実行時間計測用のブレークポイントなら記録する
+  // 取り除かれて元の命令に戻っていればそのまま実行を続ける
+  if (result == 0xa4) {
+    bool hit = coverage_hit(target_regs.pc);
+    hit |= functime_hit(&target_regs);
+    if (hit) {
+      breakpoint_sync();
+      flash_icache();
+      struct breakpoint *bp = breakpoint_find(target_regs.pc);
+      if (!(bp && (bp->flags & BP_INSERTED)))
+        return true;
+    }
+  }
+
+  // 条件付きブレークポイントで条件が成立していなければブレークポイントを越えて実行を続ける
+  // (トレースポイントならデータを収集してから判断する)
+  // gdbserver自身が挿入したブレークポイントは(範囲)ステップ実行中でも同様に越える
+  if ((request == PTRACE_CONT || request == PTRACE_SINGLESTEP) && result == 0xa4) {
+    tracepoint_hit(target_regs.pc);
+    if (!breakpoint_stop(target_regs.pc, BP_INSERTED)) {
+      step_over = true;
+      return true;
+    }
+  }
+  return false;
+}
+
 int ptrace(int request, int pid, void *addr, void *data)
 {
   int result = 0;
+  int signo = 0;
+  bool hit_pending = false;
 
   switch (request) {
     case PTRACE_PEEKTEXT:
@@ -666,55 +1093,147 @@ int ptrace(int request, int pid, void *addr, void *data)
       }
       break;
 
+    case PTRACE_IO:
+      /* addrのptrace_io_descに従ってメモリをブロック転送する
+       * piod_lenに転送できたバイト数を返す
+       * 1バイトも転送できなければerrnoにEFAULTを設定
+       */
+      {
+        struct ptrace_io_desc *piod = addr;
+        size_t len = piod->piod_len;
+        if (piod->piod_op == PIOD_READ_D)
+          piod->piod_len = memory_copy(piod->piod_addr, piod->piod_offs, len);
+        else
+          piod->piod_len = memory_copy(piod->piod_offs, piod->piod_addr, len);
+        if (len > 0 && piod->piod_len == 0) {
+          errno = EFAULT;
+          result = -1;
+        }
+      }
+      break;
+
+    case PTRACE_SETSTEPRANGE:
+      /* 次のPTRACE_SINGLESTEPで、PCがaddr～data-1の範囲にある間は
+       * gdbに戻らずにステップ実行を続ける
+       */
+      step_start = (uint32_t)addr;
+      step_end = (uint32_t)data;
+      break;
+
+    case PTRACE_REVSTEP:
+    case PTRACE_REVCONT:
+      /* 実行履歴を遡ってデバッグ対象アプリの状態を戻す
+       * PTRACE_REVSTEPは1命令、PTRACE_REVCONTはブレークポイントかウォッチポイントに
+       * 該当するか履歴の先頭に到達するまで戻す
+       * *addr: gdbのシグナル番号
+       */
+      {
+        int code = TRAP_TRACE;
+        void *si_addr = NULL;
+        for (;;) {
+          if (!record_undo(&target_regs)) {
+            code = TRAP_REPLAY;
+            break;
+          }
+          if (request == PTRACE_REVSTEP)
+            break;
+          struct watchpoint *wp;
+          if (watchpoint_active() && (wp = watchpoint_check()) != NULL) {
+            code = TRAP_WATCHPT;
+            si_addr = (void *)wp->addr;
+            break;
+          }
+          struct breakpoint *bp = breakpoint_find(target_regs.pc);
+          if (bp && (bp->flags & BP_WANTED) && breakpoint_stop(bp->addr, BP_WANTED)) {
+            code = TRAP_BRKPT;
+            break;
+          }
+          if (bp && (bp->flags & BP_HW) && breakpoint_stop(bp->addr, BP_HW)) {
+            code = TRAP_HWBKPT;
+            break;
+          }
+        }
+        target_siginfo.si_signo = 5;
+        target_siginfo.si_code = code;
+        target_siginfo.si_addr = si_addr ? si_addr : (void *)target_regs.pc;
+        *(uint32_t *)addr = 5;      // SIGTRAP
+      }
+      break;
+
+    case PTRACE_GETSIGINFO:
+      /* 直前にデバッグ対象が停止した要因をdataにコピーする
+       */
+      memcpy(data, &target_siginfo, sizeof(target_siginfo));
+      break;
+
+    case PTRACE_PEEKUSER:
+      /* pt_regsのaddrバイト目にあるレジスタ値を返す
+       */
+      {
+        struct pt_regs *regs = get_thread_regs(pid);
+        if (regs == NULL || (size_t)addr >= sizeof(*regs) || ((size_t)addr & 3)) {
+          errno = EIO;
+          result = -1;
+          break;
+        }
+        result = *(uint32_t *)((uint8_t *)regs + (size_t)addr);
+      }
+      break;
+
+    case PTRACE_POKEUSER:
+      /* pt_regsのaddrバイト目にあるレジスタにdataの値を設定する
+       */
+      {
+        struct pt_regs *regs = get_thread_regs(pid);
+        if (regs == NULL || (size_t)addr >= sizeof(*regs) || ((size_t)addr & 3)) {
+          errno = EIO;
+          result = -1;
+          break;
+        }
+        *(uint32_t *)((uint8_t *)regs + (size_t)addr) = (uint32_t)data;
+        set_thread_regs_dirty(pid, (size_t)addr == offsetof(struct pt_regs, a[7]));
+      }
+      break;
+
     case PTRACE_GETREGS:
       /* デバッグ対象アプリのレジスタ値をdataにコピーする
        */
-      if (current_tid < 0 || pid == current_tid) {
-        // 対象が現在実行中のスレッドならgdbserverが保存したレジスタ値を返す
-        update_sp();
-        memcpy(data, &target_regs, sizeof(target_regs));
-      } else {
-        // 他のスレッドならスレッド管理構造体から値を得る
-        struct dos_prcptr *prc = get_prcptr(pid);
-        struct pt_regs *dest = data;
-        memcpy(dest->d, prc->d_reg, sizeof(prc->d_reg));
-        memcpy(dest->a, prc->a_reg, sizeof(prc->a_reg));
-        dest->sr = prc->sr_reg;
-        dest->pc = prc->pc_reg;
-        dest->usp = prc->usp_reg;
-        dest->ssp = prc->ssp_reg;
-        dest->a[7] = dest->sr & 0x2000 ? dest->ssp : dest->usp;
+      {
+        struct pt_regs *regs = get_thread_regs(pid);
+        if (regs == NULL) {
+          errno = ESRCH;
+          result = -1;
+          break;
+        }
+        memcpy(data, regs, sizeof(*regs));
       }
       break;
 
     case PTRACE_SETREGS:
       /* dataをデバッグ対象アプリのレジスタ値として設定する
        */
-      struct pt_regs *newregs = data;
-      if (current_tid < 0 || pid == current_tid) {
-        // 対象が現在実行中のスレッドならgdbserverが保存したレジスタ値を変更する
+      {
+        struct pt_regs *regs = get_thread_regs(pid);
+        struct pt_regs *newregs = data;
+        if (regs == NULL) {
+          errno = ESRCH;
+          result = -1;
+          break;
+        }
         for (int i = 0; i < 8; i++) {
-          target_regs.d[i] = newregs->d[i];
-          target_regs.a[i] = newregs->a[i];
+          regs->d[i] = newregs->d[i];
+          regs->a[i] = newregs->a[i];
         }
-        target_regs.sr = newregs->sr;
-        target_regs.pc = newregs->pc;
-        retrieve_sp();
-      } else {
-        // 他のスレッドならスレッド管理構造体の値を変更する
-        struct dos_prcptr *prc = get_prcptr(pid);
-        memcpy(prc->d_reg, newregs->d, sizeof(prc->d_reg));
-        memcpy(prc->a_reg, newregs->a, sizeof(prc->a_reg));
-        prc->sr_reg = newregs->sr;
-        prc->pc_reg = newregs->pc;
-        prc->usp_reg = newregs->usp;
-        prc->ssp_reg = newregs->ssp;
+        regs->sr = newregs->sr;
+        regs->pc = newregs->pc;
+        set_thread_regs_dirty(pid, true);
       }
       break;
 
     case PTRACE_KILL:
       /* デバッグ対象アプリを終了させる
        */
+      flush_regcache();
       if (main_pi == NULL) {
         // バックグラウンドプロセスがない場合
         // PCをDOS _EXITに設定して実行を再開する
@@ -768,20 +1287,40 @@ int ptrace(int request, int pid, void *addr, void *data)
       flash_icache();
       if (request != PTRACE_KILL) {
         _dos_breakck(gdb_breakck);
+        // PCにブレークポイントが挿入されたままなら、ここで元の命令を1命令実行して越える
+        // (gdbがブレークポイントを外してステップ実行する必要はない)
+        struct breakpoint *bp = breakpoint_find(target_regs.pc);
+        step_over = bp && (bp->flags & BP_INSERTED);
+        // ブレークポイントを実行せずに(ステップ実行などで)その位置に到達していれば、
+        // 越える前にgdbserver自身が挿入したブレークポイントへの到達を記録する
+        hit_pending = step_over &&
+                      !(target_siginfo.si_code == TRAP_BRKPT &&
+                        target_siginfo.si_addr == (void *)target_regs.pc);
       }
       __asm__ ("ori.w #0x0700,%sr");
+      flush_regcache();
       resume_thread();
       set_sccrx_vector();
+      profile_attach();           // プロファイル中ならタイマ割り込みでPCをサンプリング
+      if (hit_pending) {
+        coverage_hit(target_regs.pc);
+        functime_hit(&target_regs);
+        tracepoint_hit(target_regs.pc);
+      }
       intarget = true;
-      result = (request != PTRACE_SINGLESTEP) ? do_cont() : do_singlestep();
+      do {
+        // 例外が発生したら例外スタックフレームの内容を引き上げる
+        result = run_target(request, data, &signo);
+      } while (result >= 0 && resume_again(request, result, signo));
       intarget = false;
+      step_start = step_end = 0;
+      profile_detach();
       restore_sccrx_vector();
       suspend_thread();
       _dos_breakck(2);
 
       if (result >= 0) {     // デバッグ対象の実行が中断された
-        // 例外スタックフレームの内容を引き上げる
-        *(uint32_t *)addr = decode_trap(result, data);
+        *(uint32_t *)addr = signo;
 
         // do_cont()/do_singlestep()からは割り込み禁止状態で戻ってくるので、
         // モードに応じて適切な状態に変更する
@@ -804,6 +1343,12 @@ int ptrace(int request, int pid, void *addr, void *data)
   return result;
 }
 
+/* デバッグ対象アプリのプロセス管理ポインタを得る (ロード前はNULL) */
+struct dos_psp *target_get_psp(void)
+{
+  return target_psp;
+}
+
 /* デバッグ対象アプリをメモリにロードする */
 int target_load(const char *name, struct dos_comline *cmdline, const char *env)
 {
@@ -19,22 +19,55 @@
 #define _PTRACE_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <x68k/dos.h>
 
 extern int gdbserver_debug;
 
 int target_load(const char *name, struct dos_comline *cmdline, const char *env);
+struct dos_psp *target_get_psp(void);
 int ptrace(int request, int pid, void *addr, void *data);
 
 #define PTRACE_PEEKTEXT         1
 #define PTRACE_PEEKDATA         2
+#define PTRACE_PEEKUSER         3
 #define PTRACE_POKETEXT         4
 #define PTRACE_POKEDATA         5
+#define PTRACE_POKEUSER         6
 #define PTRACE_CONT             7
 #define PTRACE_KILL             8
 #define PTRACE_SINGLESTEP       9
 #define PTRACE_GETREGS          12
 #define PTRACE_SETREGS          13
+#define PTRACE_IO               30
+#define PTRACE_GETSIGINFO       0x4202
+#define PTRACE_SETSTEPRANGE     0x8000  // gdbserver-x68k独自
+#define PTRACE_REVSTEP          0x8001  // gdbserver-x68k独自
+#define PTRACE_REVCONT          0x8002  // gdbserver-x68k独自
+
+/* PTRACE_IO */
+struct ptrace_io_desc {
+    int piod_op;        // PIOD_*
+    void *piod_offs;    // デバッグ対象のアドレス
+    void *piod_addr;    // gdbserver側のバッファ
+    size_t piod_len;    // 転送バイト数 (転送後は転送できたバイト数)
+};
+
+#define PIOD_READ_D             1
+#define PIOD_WRITE_D            2
+
+/* PTRACE_GETSIGINFO */
+struct ptrace_siginfo {
+    int si_signo;       // gdbのシグナル番号
+    int si_code;        // SIGTRAPの場合の停止要因 (TRAP_*)
+    void *si_addr;      // 停止したアドレス
+};
+
+#define TRAP_BRKPT              1   // trap #9
+#define TRAP_TRACE              2   // トレース例外
+#define TRAP_HWBKPT             4   // ハードウェアブレークポイント (Z1)
+#define TRAP_WATCHPT            5   // ウォッチポイント (gdbserver-x68k独自)
+#define TRAP_REPLAY             6   // 実行履歴の先頭に到達 (gdbserver-x68k独自)
 
 struct pt_regs {
     uint32_t d[8];      // 0
@@ -0,0 +1,512 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "record.h"
+#include "breakpoint.h"
+
+/* Execution log for reverse execution */
+/* While recording, the target is traced one instruction at a time. Before
+ * each instruction the memory it is going to write is decoded from the
+ * opcode and saved, and after it the registers which have changed are
+ * compared. The old values are pushed to a ring buffer, and bs/bc pop them
+ * to restore the previous state. The oldest entries are dropped when the
+ * buffer is full.
+ *
+ * DOS calls, IOCS calls (trap #15) and instructions whose writes cannot be
+ * decoded clear the log, so the history never goes back past them.
+ * Memory written by interrupt handlers is not logged.
+ */
+size_t record_size = RECORD_DEFAULT_SIZE;
+bool record_enabled;
+
+static uint8_t *rec_buf;
+static size_t rec_size;         // size of rec_buf (record_size when it was allocated)
+static size_t rec_head;         // position where the next entry is written
+static size_t rec_used;
+static int rec_count;
+
+/* Entry layout (sizes are stored at both ends to walk the ring backward):
+ *   size(2) pc(4) regmask(4) nmem(2) regs[n](4) { addr(4) len(2) data[len] }... size(2)
+ */
+#define REC_MAX_MEM     4
+#define REC_MAX_DATA    (16 * 4 + 8)    // movem.l of all registers
+#define REC_NREGS       20              // words of struct pt_regs
+#define REC_REG_PC      17
+#define REC_REG_A7      15              // mirror of usp/ssp, not logged
+#define REC_ENTRY_MAX   (12 + REC_NREGS * 4 + REC_MAX_MEM * 6 + REC_MAX_DATA + 2)
+
+/* State saved before the instruction is executed */
+static struct {
+  bool valid;
+  bool barrier;                 // the instruction cannot be undone
+  struct pt_regs regs;
+  int nmem;
+  uint32_t addr[REC_MAX_MEM];
+  uint16_t len[REC_MAX_MEM];
+  size_t ndata;
+  uint8_t data[REC_MAX_DATA];
+} pending;
+
+static uint8_t rec_entry[REC_ENTRY_MAX];
+
+/****************************************************************************/
+
+/* Allocate the log (if not yet) and start recording */
+/* Once allocated, the log keeps its size even if record_size is changed. */
+bool record_start(void)
+{
+  if (rec_buf == NULL) {
+    if ((rec_buf = malloc(record_size)) == NULL)
+      return false;
+    rec_size = record_size;
+  }
+  record_reset();
+  record_enabled = true;
+  return true;
+}
+
+void record_stop(void)
+{
+  record_enabled = false;
+  record_reset();
+}
+
+void record_reset(void)
+{
+  rec_head = 0;
+  rec_used = 0;
+  rec_count = 0;
+}
+
+int record_count(void)
+{
+  return rec_count;
+}
+
+size_t record_used(void)
+{
+  return rec_used;
+}
+
+/* Size of the allocated log, or the size to be allocated */
+size_t record_buffer_size(void)
+{
+  return rec_buf ? rec_size : record_size;
+}
+
+static void ring_write(size_t pos, const void *data, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+    rec_buf[(pos + i) % rec_size] = ((const uint8_t *)data)[i];
+}
+
+static void ring_read(size_t pos, void *data, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+    ((uint8_t *)data)[i] = rec_buf[(pos + i) % rec_size];
+}
+
+static bool access_memory(int op, uint32_t addr, void *buf, size_t len)
+{
+  struct ptrace_io_desc piod;
+
+  piod.piod_op = op;
+  piod.piod_offs = (void *)addr;
+  piod.piod_addr = buf;
+  piod.piod_len = len;
+  ptrace(PTRACE_IO, 0, &piod, NULL);
+  return piod.piod_len == len;
+}
+
+/****************************************************************************/
+
+/* Instruction being decoded */
+struct insn
+{
+  const struct pt_regs *regs;
+  uint32_t a[8];                // address registers (updated by source operands)
+  uint16_t w[8];                // instruction words
+  int pos;                      // index of the next extension word
+};
+
+/* Save the memory which the instruction is going to write */
+static bool save_memory(uint32_t addr, size_t len)
+{
+  if (pending.nmem == REC_MAX_MEM || pending.ndata + len > REC_MAX_DATA)
+    return false;
+  if (!access_memory(PIOD_READ_D, addr, &pending.data[pending.ndata], len))
+    return true;                // the instruction will fault and not be logged
+  pending.addr[pending.nmem] = addr;
+  pending.len[pending.nmem] = len;
+  pending.nmem++;
+  pending.ndata += len;
+  return true;
+}
+
+static int predec(int reg, int size)
+{
+  return (reg == 7 && size == 1) ? 2 : size;    // a7 is kept even
+}
+
+/* Value of the index register in a brief extension word */
+static uint32_t index_reg(struct insn *in, uint16_t ext)
+{
+  int n = (ext >> 12) & 7;
+  uint32_t v = (ext & 0x8000) ? in->a[n] : in->regs->d[n];
+  if (!(ext & 0x0800))
+    v = (int16_t)v;
+  return v << ((ext >> 9) & 3);   // scale (68020 and later)
+}
+
+/* Address of a memory operand, or false for register and unsupported modes */
+/* Postincrement/predecrement are applied to in->a[] as the CPU does. */
+static bool operand_addr(struct insn *in, int mode, int reg, int size, uint32_t *addr, bool *mem)
+{
+  uint16_t ext;
+
+  *mem = true;
+  switch (mode) {
+  case 0:
+  case 1:
+    *mem = false;
+    return true;
+  case 2:
+    *addr = in->a[reg];
+    return true;
+  case 3:
+    *addr = in->a[reg];
+    in->a[reg] += predec(reg, size);
+    return true;
+  case 4:
+    in->a[reg] -= predec(reg, size);
+    *addr = in->a[reg];
+    return true;
+  case 5:
+    *addr = in->a[reg] + (int16_t)in->w[in->pos++];
+    return true;
+  case 6:
+    ext = in->w[in->pos++];
+    if (ext & 0x0100)
+      return false;             // full extension word format (68020)
+    *addr = in->a[reg] + index_reg(in, ext) + (int8_t)ext;
+    return true;
+  }
+
+  switch (reg) {
+  case 0:                       // abs.w
+    *addr = (int16_t)in->w[in->pos++];
+    return true;
+  case 1:                       // abs.l
+    *addr = (in->w[in->pos] << 16) | in->w[in->pos + 1];
+    in->pos += 2;
+    return true;
+  case 2:                       // (d16,pc)
+    in->pos++;
+    *mem = false;
+    return true;
+  case 3:                       // (d8,pc,xn)
+    ext = in->w[in->pos++];
+    *mem = false;
+    return !(ext & 0x0100);
+  case 4:                       // #imm
+    in->pos += (size == 4) ? 2 : 1;
+    *mem = false;
+    return true;
+  }
+  return false;
+}
+
+/* Skip a source operand */
+static bool source(struct insn *in, int mode, int reg, int size)
+{
+  uint32_t addr;
+  bool mem;
+  return operand_addr(in, mode, reg, size, &addr, &mem);
+}
+
+/* Save the memory written by a destination operand */
+static bool dest(struct insn *in, int mode, int reg, int size)
+{
+  uint32_t addr;
+  bool mem;
+  if (!operand_addr(in, mode, reg, size, &addr, &mem))
+    return false;
+  return !mem || save_memory(addr, size);
+}
+
+/* Save the memory which the instruction at the PC writes */
+/* Returns false if the writes cannot be known. */
+static bool decode(struct insn *in)
+{
+  uint16_t op = in->w[0];
+  int mode = (op >> 3) & 7;
+  int reg = op & 7;
+  int size = "\x01\x02\x04\x00"[(op >> 6) & 3];
+  uint32_t sp = in->a[7];
+  int n;
+
+  switch (op >> 12) {
+  case 0x0:
+    if ((op & 0x0138) == 0x0108) {          // MOVEP
+      if (!(op & 0x0080))
+        return true;
+      return save_memory(in->a[reg] + (int16_t)in->w[1], (op & 0x0040) ? 7 : 3);
+    }
+    if ((op & 0x0100) || (op & 0x0f00) == 0x0800) {   // BTST/BCHG/BCLR/BSET
+      if ((op & 0x00c0) == 0)
+        return true;
+      if (!(op & 0x0100))
+        in->pos++;              // bit number
+      return dest(in, mode, reg, mode == 0 ? 4 : 1);
+    }
+    if (size == 0)                          // CAS, CAS2, CHK2, CMP2, ...
+      return false;
+    if ((op & 0x0f00) == 0x0e00)            // MOVES (alternate address space)
+      return false;
+    if ((op & 0x0e00) == 0x0c00)            // CMPI
+      return true;
+    if (mode == 7 && reg == 4)              // to CCR/SR
+      return true;
+    in->pos += (size == 4) ? 2 : 1;
+    return dest(in, mode, reg, size);
+
+  case 0x1:                                 // MOVE
+  case 0x2:
+  case 0x3:
+    size = "\x00\x01\x04\x02"[op >> 12];
+    if (!source(in, mode, reg, size))
+      return false;
+    return dest(in, (op >> 6) & 7, (op >> 9) & 7, size);
+
+  case 0x4:
+    if ((op & 0xfdc0) == 0x40c0)            // MOVE from SR/CCR
+      return dest(in, mode, reg, 2);
+    if ((op & 0xf900) == 0x4000 && size)    // NEGX/CLR/NEG/NOT
+      return dest(in, mode, reg, size);
+    if ((op & 0xfff8) == 0x4808)            // LINK.L
+      return save_memory(sp - 4, 4);
+    if ((op & 0xffc0) == 0x4800)            // NBCD
+      return dest(in, mode, reg, 1);
+    if ((op & 0xffc0) == 0x4840)            // SWAP/BKPT/PEA
+      return mode < 2 || save_memory(sp - 4, 4);
+    if ((op & 0xfb80) == 0x4880 && mode != 0) {   // MOVEM
+      if (op & 0x0400)
+        return true;            // memory to registers
+      uint16_t mask = in->w[in->pos++];
+      size = (op & 0x0040) ? 4 : 2;
+      for (n = 0; mask; mask >>= 1)
+        n += mask & 1;
+      if (mode == 4)
+        return save_memory(in->a[reg] - n * size, n * size);
+      uint32_t addr;
+      bool mem;
+      return operand_addr(in, mode, reg, size, &addr, &mem) &&
+             (!mem || save_memory(addr, n * size));
+    }
+    if ((op & 0xffc0) == 0x4ac0)            // TAS/ILLEGAL
+      return op == 0x4afc || dest(in, mode, reg, 1);
+    if (op == 0x4e4f)                       // IOCS call
+      return false;
+    if ((op & 0xfff0) == 0x4e40)            // TRAP #n (exception frame)
+      return save_memory(in->regs->ssp - 8, 8);
+    if ((op & 0xfff8) == 0x4e50)            // LINK
+      return save_memory(sp - 4, 4);
+    if ((op & 0xffc0) == 0x4e80)            // JSR
+      return save_memory(sp - 4, 4);
+    return true;
+
+  case 0x5:
+    if (size)                               // ADDQ/SUBQ
+      return dest(in, mode, reg, size);
+    if (mode == 1 || (mode == 7 && reg >= 2))   // DBcc/TRAPcc
+      return true;
+    return dest(in, mode, reg, 1);          // Scc
+
+  case 0x6:
+    if ((op & 0xff00) == 0x6100)            // BSR
+      return save_memory(sp - 4, 4);
+    return true;
+
+  case 0x8:
+  case 0x9:
+  case 0xb:
+  case 0xc:
+  case 0xd:
+    if (!(op & 0x0100) || size == 0 || mode == 0)
+      return true;              // to Dn, CMP, *A, register forms of *X/*BCD, EXG
+    if (mode == 1) {            // -(Ay),-(Ax) forms
+      int x = (op >> 9) & 7;
+      switch (op >> 12) {
+      case 0x8:
+        if (size != 1)
+          return false;         // PACK/UNPK
+        break;
+      case 0xb:
+        return true;            // CMPM
+      case 0xc:
+        if (size != 1)
+          return true;          // EXG
+        break;
+      }
+      in->a[reg] -= predec(reg, size);
+      return save_memory(in->a[x] - predec(x, size), size);
+    }
+    return dest(in, mode, reg, size);
+
+  case 0xe:
+    if ((op & 0xf8c0) == 0xe8c0)            // bit field (68020)
+      return false;
+    if ((op & 0x00c0) == 0x00c0)            // memory shift/rotate
+      return dest(in, mode, reg, 2);
+    return true;
+
+  case 0x7:                                 // MOVEQ
+    return true;
+  }
+  return false;                             // A-line, F-line (DOS call, FPU)
+}
+
+/* Called before tracing one instruction */
+void record_begin(const struct pt_regs *regs)
+{
+  struct insn in;
+
+  pending.valid = true;
+  pending.regs = *regs;
+  pending.nmem = 0;
+  pending.ndata = 0;
+
+  in.regs = regs;
+  memcpy(in.a, regs->a, sizeof(in.a));
+  in.a[7] = (regs->sr & 0x2000) ? regs->ssp : regs->usp;
+  in.pos = 1;
+  memset(in.w, 0, sizeof(in.w));
+  access_memory(PIOD_READ_D, regs->pc, in.w, sizeof(in.w));
+  breakpoint_mask(regs->pc, (uint8_t *)in.w, sizeof(in.w));
+  pending.barrier = !decode(&in);
+}
+
+/* Called after the instruction, with completed false if it did not complete */
+void record_end(const struct pt_regs *regs, bool completed)
+{
+  if (!pending.valid)
+    return;
+  pending.valid = false;
+  if (!completed)
+    return;
+  if (pending.barrier) {
+    record_reset();
+    return;
+  }
+
+  // Build the entry
+  uint8_t *p = &rec_entry[2];
+  uint32_t mask = 0;
+  uint16_t nmem = pending.nmem;
+  const uint32_t *old = (const uint32_t *)&pending.regs;
+  const uint32_t *new = (const uint32_t *)regs;
+
+  for (int i = 0; i < REC_NREGS; i++) {
+    if (i != REC_REG_PC && i != REC_REG_A7 && old[i] != new[i])
+      mask |= 1 << i;
+  }
+  memcpy(p, &pending.regs.pc, 4);
+  memcpy(p + 4, &mask, 4);
+  memcpy(p + 8, &nmem, 2);
+  p += 10;
+  for (int i = 0; i < REC_NREGS; i++) {
+    if (mask & (1 << i)) {
+      memcpy(p, &old[i], 4);
+      p += 4;
+    }
+  }
+  uint8_t *data = pending.data;
+  for (int i = 0; i < nmem; i++) {
+    memcpy(p, &pending.addr[i], 4);
+    memcpy(p + 4, &pending.len[i], 2);
+    memcpy(p + 6, data, pending.len[i]);
+    p += 6 + pending.len[i];
+    data += pending.len[i];
+  }
+  uint16_t size = p + 2 - rec_entry;
+  memcpy(rec_entry, &size, 2);
+  memcpy(p, &size, 2);
+
+  // Drop the oldest entries to make room
+  while (rec_used + size > rec_size && rec_count > 0) {
+    uint16_t oldest;
+    ring_read((rec_head + rec_size - rec_used) % rec_size, &oldest, 2);
+    rec_used -= oldest;
+    rec_count--;
+  }
+  if (size > rec_size)
+    return;
+  ring_write(rec_head, rec_entry, size);
+  rec_head = (rec_head + size) % rec_size;
+  rec_used += size;
+  rec_count++;
+}
+
+/* Restore the state before the last logged instruction */
+bool record_undo(struct pt_regs *regs)
+{
+  uint16_t size;
+
+  if (rec_count == 0)
+    return false;
+  ring_read((rec_head + rec_size - 2) % rec_size, &size, 2);
+  rec_head = (rec_head + rec_size - size) % rec_size;
+  ring_read(rec_head, rec_entry, size);
+  rec_used -= size;
+  rec_count--;
+
+  uint8_t *p = &rec_entry[2];
+  uint32_t mask;
+  uint16_t nmem;
+  uint32_t *r = (uint32_t *)regs;
+
+  memcpy(&regs->pc, p, 4);
+  memcpy(&mask, p + 4, 4);
+  memcpy(&nmem, p + 8, 2);
+  p += 10;
+  for (int i = 0; i < REC_NREGS; i++) {
+    if (mask & (1 << i)) {
+      memcpy(&r[i], p, 4);
+      p += 4;
+    }
+  }
+  regs->a[7] = (regs->sr & 0x2000) ? regs->ssp : regs->usp;
+
+  // Memory blocks are restored in reverse order in case they overlap
+  uint8_t *blocks[REC_MAX_MEM];
+  for (int i = 0; i < nmem; i++) {
+    uint16_t len;
+    blocks[i] = p;
+    memcpy(&len, p + 4, 2);
+    p += 6 + len;
+  }
+  while (nmem-- > 0) {
+    uint32_t addr;
+    uint16_t len;
+    memcpy(&addr, blocks[nmem], 4);
+    memcpy(&len, blocks[nmem] + 4, 2);
+    access_memory(PIOD_WRITE_D, addr, blocks[nmem] + 6, len);
+  }
+  return true;
+}
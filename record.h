@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "ptrace.h"
+
+#define RECORD_DEFAULT_SIZE     0x10000
+
+extern size_t record_size;      // size of the execution log in bytes
+extern bool record_enabled;
+
+bool record_start(void);
+void record_stop(void);
+void record_reset(void);
+int record_count(void);
+size_t record_used(void);
+size_t record_buffer_size(void);
+void record_begin(const struct pt_regs *regs);
+void record_end(const struct pt_regs *regs, bool completed);
+bool record_undo(struct pt_regs *regs);
+
+/* Whether every instruction has to be traced and logged */
+#define record_active()         (record_enabled)
+
+#endif /* RECORD_H */
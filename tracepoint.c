@@ -0,0 +1,589 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "tracepoint.h"
+#include "breakpoint.h"
+#include "ptrace.h"
+#include "pthreadlib.h"
+
+/* Tracepoints */
+/* A tracepoint is a trap #9 planted by QTStart. When the target hits it,
+ * the registers and memory requested by the tracepoint actions are appended
+ * to the trace buffer as a trace frame and the target continues without
+ * talking to gdb. The frames are inspected later with QTFrame ("tfind").
+ */
+#define TRACEPOINT_NUMBER   32
+#define TRACE_VAR_NUMBER    32
+#define TRACE_BUFFER_SIZE   0x10000
+#define TRACE_NREGS         18      // d0-d7/a0-a7/ps/pc (the "g" packet layout)
+
+static struct tracepoint tp_table[TRACEPOINT_NUMBER];
+static int tp_num;
+
+/* Trace state variables (QTDV, getv/setv/tracev bytecodes) */
+struct trace_variable
+{
+  uint32_t num;
+  int32_t initial;
+  int32_t value;
+};
+
+static struct trace_variable tv_table[TRACE_VAR_NUMBER];
+static int tv_num;
+
+int trace_status = TRACE_NOTRUN;
+uint32_t trace_stop_tp;
+int trace_frame = -1;
+
+/* Trace buffer */
+/* Each frame is a header followed by blocks, all aligned to 2 bytes:
+ *   'R' pad regs[TRACE_NREGS]              registers
+ *   'M' pad addr(4) len(2) data[len]       memory
+ *   'V' pad num(4) value(4)                trace state variable
+ */
+struct frame_header
+{
+  uint32_t tpnum;
+  uint32_t addr;
+  uint32_t size;                // size of the blocks following the header
+};
+
+static uint8_t *trace_buf;
+static size_t trace_used;
+static int trace_frames;
+static bool trace_collecting;   // a frame is being collected
+static bool trace_overflow;     // the frame did not fit in the buffer
+
+#define ALIGN2(n)   (((n) + 1) & ~1)
+
+/****************************************************************************/
+
+static struct tracepoint *tp_find(uint32_t num, uint32_t addr)
+{
+  for (int i = 0; i < tp_num; i++) {
+    if (tp_table[i].num == num && tp_table[i].addr == addr)
+      return &tp_table[i];
+  }
+  return NULL;
+}
+
+static struct trace_variable *tv_find(uint32_t num)
+{
+  for (int i = 0; i < tv_num; i++) {
+    if (tv_table[i].num == num)
+      return &tv_table[i];
+  }
+  return NULL;
+}
+
+/* Delete all tracepoints, trace state variables and frames (QTinit) */
+void tracepoint_init(void)
+{
+  tracepoint_stop();
+  for (int i = 0; i < tp_num; i++) {
+    agent_free(tp_table[i].cond);
+    agent_free(tp_table[i].exprs);
+  }
+  tp_num = 0;
+  tv_num = 0;
+  trace_used = 0;
+  trace_frames = 0;
+  trace_frame = -1;
+  trace_status = TRACE_NOTRUN;
+}
+
+/* Define a tracepoint or add actions to it (QTDP) */
+/* "n:addr:E|D:step:pass[:Fflen][:Xlen,cond][-]" defines a tracepoint and
+ * "-n:addr:action...[-]" adds actions to it. Actions are "R<mask>",
+ * "M<basereg>,<offset>,<len>" and "X<len>,<bytecode>". While-stepping
+ * ("S" prefixed) actions are accepted and ignored.
+ */
+bool tracepoint_define(char *p)
+{
+  bool actions = (*p == '-');
+  if (actions)
+    p++;
+  uint32_t num = strtoul(p, &p, 16);
+  if (*p++ != ':')
+    return false;
+  uint32_t addr = strtoul(p, &p, 16);
+  if (*p++ != ':')
+    return false;
+
+  if (!actions) {
+    struct tracepoint *tp;
+    if (tp_num == TRACEPOINT_NUMBER || (addr & 1) || tp_find(num, addr))
+      return false;
+    tp = &tp_table[tp_num];
+    memset(tp, 0, sizeof(*tp));
+    tp->num = num;
+    tp->addr = addr;
+    tp->enabled = (*p++ == 'E');
+    if (*p++ != ':')
+      return false;
+    tp->step = strtoul(p, &p, 16);
+    if (*p++ != ':')
+      return false;
+    tp->pass = strtoul(p, &p, 16);
+    while (*p == ':') {
+      p++;
+      if (*p == 'F') {
+        return false;           // fast tracepoints are not supported
+      } else if (*p == 'X') {
+        if ((tp->cond = agent_parse(&p)) == NULL)
+          return false;
+      } else {
+        break;
+      }
+    }
+    tp_num++;
+    return true;
+  }
+
+  struct tracepoint *tp = tp_find(num, addr);
+  struct agent_expr **tail;
+  if (tp == NULL)
+    return false;
+  for (tail = &tp->exprs; *tail; tail = &(*tail)->next)
+    ;
+
+  while (*p && *p != '-') {
+    switch (*p) {
+    case 'R':
+      tp->regmask = strtoul(p + 1, &p, 16);
+      break;
+    case 'M':
+      if (tp->nmem == TRACE_MEM_MAX)
+        return false;
+      {
+        struct trace_mem *m = &tp->mem[tp->nmem];
+        m->basereg = (int)strtoul(p + 1, &p, 16);     // -1 is sent as ffffffff
+        if (*p++ != ',')
+          return false;
+        m->offset = strtoul(p, &p, 16);
+        if (*p++ != ',')
+          return false;
+        m->len = strtoul(p, &p, 16);
+        if (m->basereg >= TRACE_NREGS)
+          return false;
+        tp->nmem++;
+      }
+      break;
+    case 'X':
+      if ((*tail = agent_parse(&p)) == NULL)
+        return false;
+      tail = &(*tail)->next;
+      break;
+    case 'S':
+      p += strlen(p);
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Define a trace state variable (QTDV) */
+/* "n:value:builtin:name" */
+bool tracepoint_variable(char *p)
+{
+  uint32_t num = strtoul(p, &p, 16);
+  if (*p++ != ':')
+    return false;
+  int32_t value = strtoull(p, &p, 16);    // 64-bit value truncated to 32 bits
+
+  struct trace_variable *tv = tv_find(num);
+  if (tv == NULL) {
+    if (tv_num == TRACE_VAR_NUMBER)
+      return false;
+    tv = &tv_table[tv_num++];
+    tv->num = num;
+  }
+  tv->initial = tv->value = value;
+  return true;
+}
+
+bool tracepoint_get_variable(uint32_t num, int32_t *value)
+{
+  struct trace_variable *tv = tv_find(num);
+  if (tv == NULL)
+    return false;
+  *value = tv->value;
+  return true;
+}
+
+struct tracepoint *tracepoint_get(int index)
+{
+  return index < tp_num ? &tp_table[index] : NULL;
+}
+
+/* Plant the tracepoints and start collecting (QTStart) */
+/* The traps are written to the target by breakpoint_sync() at the next resume. */
+bool tracepoint_start(void)
+{
+  if (trace_buf == NULL && (trace_buf = malloc(TRACE_BUFFER_SIZE)) == NULL)
+    return false;
+
+  tracepoint_stop();
+  trace_used = 0;
+  trace_frames = 0;
+  trace_frame = -1;
+  for (int i = 0; i < tv_num; i++)
+    tv_table[i].value = tv_table[i].initial;
+  for (int i = 0; i < tp_num; i++) {
+    struct tracepoint *tp = &tp_table[i];
+    tp->hits = 0;
+    if (tp->enabled && !breakpoint_insert(tp->addr, BP_TRACE)) {
+      tracepoint_stop();
+      return false;
+    }
+  }
+  trace_status = TRACE_RUNNING;
+  return true;
+}
+
+/* Stop collecting and remove the tracepoints (QTStop) */
+void tracepoint_stop(void)
+{
+  for (int i = 0; i < tp_num; i++)
+    breakpoint_remove(tp_table[i].addr, BP_TRACE);
+  if (trace_status == TRACE_RUNNING)
+    trace_status = TRACE_STOPPED;
+}
+
+/****************************************************************************/
+
+/* Append a block to the frame being collected */
+static void *trace_alloc(size_t len)
+{
+  len = ALIGN2(len);
+  if (trace_used + len > TRACE_BUFFER_SIZE) {
+    trace_overflow = true;
+    return NULL;
+  }
+  void *p = &trace_buf[trace_used];
+  trace_used += len;
+  return p;
+}
+
+/* Record a memory block (memory which cannot be read is skipped) */
+static bool trace_memory(uint32_t addr, size_t length)
+{
+  if (length > 0xffff)
+    length = 0xffff;
+
+  size_t start = trace_used;
+  uint8_t *b = trace_alloc(8 + length);
+  if (b == NULL)
+    return false;
+
+  struct ptrace_io_desc piod;
+  piod.piod_op = PIOD_READ_D;
+  piod.piod_offs = (void *)addr;
+  piod.piod_addr = &b[8];
+  piod.piod_len = length;
+  ptrace(PTRACE_IO, 0, &piod, NULL);
+  breakpoint_mask(addr, &b[8], piod.piod_len);
+
+  uint16_t len = piod.piod_len;
+  if (len == 0) {
+    trace_used = start;
+    return true;
+  }
+  b[0] = 'M';
+  memcpy(&b[2], &addr, 4);
+  memcpy(&b[6], &len, 2);
+  trace_used = start + ALIGN2(8 + len);
+  return true;
+}
+
+static bool trace_variable(uint32_t num)
+{
+  struct trace_variable *tv = tv_find(num);
+  if (tv == NULL)
+    return false;
+
+  uint8_t *b = trace_alloc(10);
+  if (b == NULL)
+    return false;
+  b[0] = 'V';
+  memcpy(&b[2], &tv->num, 4);
+  memcpy(&b[6], &tv->value, 4);
+  return true;
+}
+
+/* Collect one trace frame for the tracepoint */
+static bool trace_collect(struct tracepoint *tp)
+{
+  size_t start = trace_used;
+  struct frame_header h;
+
+  trace_overflow = false;
+  if (trace_alloc(sizeof(h)) == NULL)
+    return false;
+  trace_collecting = true;
+
+  struct pt_regs regs;
+  ptrace(PTRACE_GETREGS, current_tid, NULL, &regs);
+  if (tp->regmask) {
+    uint8_t *b = trace_alloc(2 + TRACE_NREGS * 4);
+    if (b) {
+      b[0] = 'R';
+      memcpy(&b[2], &regs, TRACE_NREGS * 4);
+    }
+  }
+  for (int i = 0; i < tp->nmem && !trace_overflow; i++) {
+    struct trace_mem *m = &tp->mem[i];
+    uint32_t addr = m->offset;
+    if (m->basereg >= 0)
+      addr += ((uint32_t *)&regs)[m->basereg];
+    trace_memory(addr, m->len);
+  }
+  for (struct agent_expr *ax = tp->exprs; ax && !trace_overflow; ax = ax->next) {
+    int32_t value;
+    agent_eval(ax, &value);
+  }
+
+  trace_collecting = false;
+  if (trace_overflow) {
+    trace_used = start;
+    return false;
+  }
+  h.tpnum = tp->num;
+  h.addr = tp->addr;
+  h.size = trace_used - start - sizeof(h);
+  memcpy(&trace_buf[start], &h, sizeof(h));
+  trace_frames++;
+  return true;
+}
+
+/* Collect the tracepoints at addr */
+/* Called in the target context when it hit trap #9. Once tracing has
+ * stopped (buffer full or pass count), the traps stay in place until the
+ * next QTStop/QTStart but nothing is recorded any more.
+ */
+void tracepoint_hit(size_t addr)
+{
+  if (trace_status != TRACE_RUNNING)
+    return;
+
+  for (int i = 0; i < tp_num; i++) {
+    struct tracepoint *tp = &tp_table[i];
+    if (tp->addr != addr || !tp->enabled)
+      continue;
+    if (tp->cond) {
+      int32_t value;
+      if (agent_eval(tp->cond, &value) < 0 || !value)
+        continue;
+    }
+    tp->hits++;
+    if (!trace_collect(tp)) {
+      trace_status = TRACE_FULL;
+      return;
+    }
+    if (tp->pass && tp->hits >= tp->pass) {
+      trace_status = TRACE_PASSCOUNT;
+      trace_stop_tp = tp->num;
+      return;
+    }
+  }
+}
+
+/* Tracing bytecodes called from agent_eval() */
+/* They do nothing outside tracepoint collection (e.g. in a breakpoint
+ * condition). Only a full buffer is reported as an error.
+ */
+bool agent_trace(uint32_t addr, size_t length)
+{
+  if (!trace_collecting)
+    return true;
+  return trace_memory(addr, length);
+}
+
+bool agent_tracev(uint32_t num)
+{
+  if (!trace_collecting)
+    return true;
+  return trace_variable(num) || !trace_overflow;
+}
+
+bool agent_getv(uint32_t num, int32_t *value)
+{
+  return tracepoint_get_variable(num, value);
+}
+
+bool agent_setv(uint32_t num, int32_t value)
+{
+  struct trace_variable *tv = tv_find(num);
+  if (tv == NULL)
+    return false;
+  tv->value = value;
+  return true;
+}
+
+/****************************************************************************/
+
+int trace_frame_count(void)
+{
+  return trace_frames;
+}
+
+size_t trace_buffer_used(void)
+{
+  return trace_used;
+}
+
+size_t trace_buffer_size(void)
+{
+  return TRACE_BUFFER_SIZE;
+}
+
+/* Returns the offset of the n-th frame in the trace buffer */
+static size_t frame_offset(int n)
+{
+  size_t offset = 0;
+
+  while (n-- > 0) {
+    struct frame_header h;
+    memcpy(&h, &trace_buf[offset], sizeof(h));
+    offset += sizeof(h) + h.size;
+  }
+  return offset;
+}
+
+/* Select a trace frame (QTFrame) */
+/* args is "<n>", "pc:<addr>", "tdp:<t>", "range:<start>:<end>" or
+ * "outside:<start>:<end>". Searches start after the current frame.
+ * Returns the selected frame number (-1: none) and its tracepoint.
+ */
+int trace_frame_find(char *args, uint32_t *tpnum)
+{
+  int type = 0;
+  uint32_t a = 0, b = 0;
+
+  if (!strncmp(args, "pc:", 3)) {
+    type = 1;
+    a = strtoul(args + 3, NULL, 16);
+  } else if (!strncmp(args, "tdp:", 4)) {
+    type = 2;
+    a = strtoul(args + 4, NULL, 16);
+  } else if (!strncmp(args, "range:", 6) || !strncmp(args, "outside:", 8)) {
+    type = (args[0] == 'r') ? 3 : 4;
+    a = strtoul(strchr(args, ':') + 1, &args, 16);
+    if (*args == ':')
+      b = strtoul(args + 1, NULL, 16);
+  } else {
+    int n = strtoul(args, NULL, 16);
+    trace_frame = (n >= 0 && n < trace_frames) ? n : -1;
+    if (trace_frame >= 0) {
+      struct frame_header h;
+      memcpy(&h, &trace_buf[frame_offset(n)], sizeof(h));
+      *tpnum = h.tpnum;
+    }
+    return trace_frame;
+  }
+
+  int n = trace_frame + 1;
+  size_t offset = frame_offset(n);
+  for (; n < trace_frames; n++) {
+    struct frame_header h;
+    memcpy(&h, &trace_buf[offset], sizeof(h));
+    offset += sizeof(h) + h.size;
+    if ((type == 1 && h.addr == a) ||
+        (type == 2 && h.tpnum == a) ||
+        (type == 3 && h.addr >= a && h.addr <= b) ||
+        (type == 4 && (h.addr < a || h.addr > b))) {
+      *tpnum = h.tpnum;
+      return trace_frame = n;
+    }
+  }
+  return trace_frame = -1;
+}
+
+/* Returns the first block of the type after the block 'after' in the selected frame */
+static uint8_t *frame_block(int type, const uint8_t *after)
+{
+  struct frame_header h;
+  size_t offset = frame_offset(trace_frame);
+  memcpy(&h, &trace_buf[offset], sizeof(h));
+  uint8_t *b = &trace_buf[offset + sizeof(h)];
+  uint8_t *end = b + h.size;
+
+  while (b < end) {
+    uint8_t *next;
+    if (b[0] == 'R') {
+      next = b + 2 + TRACE_NREGS * 4;
+    } else if (b[0] == 'M') {
+      uint16_t len;
+      memcpy(&len, &b[6], 2);
+      next = b + ALIGN2(8 + len);
+    } else {
+      next = b + 10;
+    }
+    if (b[0] == type && b > after)
+      return b;
+    b = next;
+  }
+  return NULL;
+}
+
+/* Registers of the selected frame (d0-d7/a0-a7/ps/pc) */
+/* Returns false if they were not collected. pc is always available. */
+bool trace_frame_regs(uint32_t *regs, uint32_t *pc)
+{
+  struct frame_header h;
+  memcpy(&h, &trace_buf[frame_offset(trace_frame)], sizeof(h));
+  *pc = h.addr;
+
+  uint8_t *b = frame_block('R', NULL);
+  if (b == NULL)
+    return false;
+  memcpy(regs, &b[2], TRACE_NREGS * 4);
+  return true;
+}
+
+/* Read memory collected in the selected frame */
+/* Returns the number of bytes available from addr. */
+size_t trace_frame_memory(size_t addr, uint8_t *buf, size_t length)
+{
+  size_t done = 0;
+
+  while (done < length) {
+    uint8_t *b = NULL;
+    size_t n = 0;
+    while ((b = frame_block('M', b)) != NULL) {
+      uint32_t start;
+      uint16_t len;
+      memcpy(&start, &b[2], 4);
+      memcpy(&len, &b[6], 2);
+      if (addr + done >= start && addr + done < start + len) {
+        n = start + len - (addr + done);
+        if (n > length - done)
+          n = length - done;
+        memcpy(&buf[done], &b[8 + addr + done - start], n);
+        break;
+      }
+    }
+    if (n == 0)
+      break;
+    done += n;
+  }
+  return done;
+}
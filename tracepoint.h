@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2023-2025 Yuichi Nakamura (@yunkya2)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACEPOINT_H
+#define TRACEPOINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "agent.h"
+
+#define TRACE_MEM_MAX   8
+
+/* Memory range collected at a tracepoint ("M" action) */
+struct trace_mem
+{
+  int basereg;                  // register number, or -1 for an absolute address
+  int32_t offset;
+  uint32_t len;
+};
+
+struct tracepoint
+{
+  uint32_t num;
+  uint32_t addr;
+  bool enabled;
+  uint32_t step;                // while-stepping count (accepted but not performed)
+  uint32_t pass;                // stop tracing after this many hits (0: never)
+  uint32_t hits;
+  uint32_t regmask;             // "R" action (nonzero: collect all registers)
+  int nmem;
+  struct trace_mem mem[TRACE_MEM_MAX];
+  struct agent_expr *cond;      // collect only when true (NULL: always)
+  struct agent_expr *exprs;     // "X" actions
+};
+
+/* Tracing state reported by qTStatus */
+enum {
+  TRACE_NOTRUN,                 // not started since QTinit
+  TRACE_RUNNING,
+  TRACE_STOPPED,                // by QTStop
+  TRACE_FULL,                   // the trace buffer is full
+  TRACE_PASSCOUNT,              // a tracepoint reached its pass count
+};
+
+extern int trace_status;
+extern uint32_t trace_stop_tp;  // tracepoint which stopped tracing (TRACE_PASSCOUNT)
+extern int trace_frame;         // selected trace frame (-1: inspect the live target)
+
+void tracepoint_init(void);
+bool tracepoint_define(char *p);
+bool tracepoint_variable(char *p);
+bool tracepoint_get_variable(uint32_t num, int32_t *value);
+struct tracepoint *tracepoint_get(int index);
+bool tracepoint_start(void);
+void tracepoint_stop(void);
+void tracepoint_hit(size_t addr);
+
+int trace_frame_count(void);
+size_t trace_buffer_used(void);
+size_t trace_buffer_size(void);
+int trace_frame_find(char *args, uint32_t *tpnum);
+bool trace_frame_regs(uint32_t *regs, uint32_t *pc);
+size_t trace_frame_memory(size_t addr, uint8_t *buf, size_t length);
+
+#endif /* TRACEPOINT_H */